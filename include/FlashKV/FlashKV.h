@@ -17,7 +17,7 @@
  *
  * Author: Joe Inman
  * Email: joe.inman8@gmail.com
- * Version: 1.0
+ * Version: 2.0
  *
  * Description:
  * FlashKV is designed to provide a straightforward and customizable
@@ -28,27 +28,363 @@
 
 #pragma once
 
+#ifdef FLASHKV_ORDERED_INDEX
+#include <map>
+#else
 #include <unordered_map>
+#endif
+#include <atomic>
 #include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
 
 namespace FlashKV
 {
-    // FlashKV Signature
+    // FlashKV Signature (Maps Written By FlashKV 1.0)
     const uint8_t FLASHKV_SIGNATURE[4] = {'F', 'K', 'V', 'S'};
     const uint8_t FLASHKV_SIGNATURE_SIZE = sizeof(FLASHKV_SIGNATURE);
 
+    // FlashKV Sector Format
+    const uint8_t FLASHKV_SECTOR_SIGNATURE[4] = {'F', 'K', 'V', 'L'};
+    const uint8_t FLASHKV_SECTOR_HEADER_SIZE = 20; // Signature, Sequence, Erase Count, Key Count, CRC
+    const uint8_t FLASHKV_JOURNAL_SIGNATURE[4] = {'F', 'K', 'V', 'J'};
+    const uint8_t FLASHKV_RETAINED_SIGNATURE[4] = {'F', 'K', 'V', 'R'};
+    const uint8_t FLASHKV_RETAINED_ENTRY_SIZE = 13; // Location, Stored Size, Key Size, Value Size, Erased
+    const uint8_t FLASHKV_RECORD_HEADER_SIZE = 10; // Magic, Type, Key Size, Value Size, CRC
+    const uint8_t FLASHKV_APPEND_HEADER_SIZE = 6;  // Size Limit, Location Of The Record Extended
+    const uint8_t FLASHKV_RECORD_MAGIC = 0xA5;
+    const uint8_t FLASHKV_ERASED_VALUE = 0xFF;
+    const uint8_t FLASHKV_READ_ATTEMPTS = 4; // Copies Tried By readKeyInto() Before Giving Up On A Value Being Written
+    const uint32_t FLASHKV_NO_LOCATION = UINT32_MAX;
+
+    // FlashKV Wear Levelling
+    const uint32_t FLASHKV_DEFAULT_ERASE_SKEW = 100; // Erase Count Gap That Moves Cold Data
+
+#ifdef FLASHKV_EMBEDDED
+    /**
+     * @brief Provides the memory used by every FlashKV object in embedded builds.
+     *
+     * FlashKV allocates from this buffer instead of the heap. Set it before constructing any FlashKV object and
+     * keep it alive until every object has been destroyed. Writes, appends and erases check that everything they
+     * could allocate fits in the largest free block first, and return false if it does not. Other allocations, such
+     * as loading, the commit buffer and sector state, call std::abort() when the buffer runs out, so size the buffer
+     * from memoryUsage() with headroom for them.
+     *
+     * @param buffer The buffer to allocate from.
+     * @param size The size of the buffer in bytes.
+     */
+    void setStaticBuffer(void *buffer, size_t size);
+
+    // Allocation From The Static Buffer
+    void *allocateStatic(size_t size);
+    void deallocateStatic(void *pointer);
+    size_t largestStaticBlock();
+
+    /**
+     * @struct StaticAllocator
+     * @brief Allocator drawing from the buffer given to setStaticBuffer().
+     */
+    template <typename T>
+    struct StaticAllocator
+    {
+        using value_type = T;
+
+        StaticAllocator() = default;
+        template <typename U>
+        StaticAllocator(const StaticAllocator<U> &) {}
+
+        T *allocate(size_t count) { return static_cast<T *>(allocateStatic(count * sizeof(T))); }
+        void deallocate(T *pointer, size_t) { deallocateStatic(pointer); }
+
+        template <typename U>
+        bool operator==(const StaticAllocator<U> &) const { return true; }
+        template <typename U>
+        bool operator!=(const StaticAllocator<U> &) const { return false; }
+    };
+
+    /**
+     * @class Callback
+     * @brief A function pointer with an optional context, used in place of std::function in embedded builds.
+     *
+     * Captureless lambdas convert implicitly. State is passed through the context pointer instead of captures.
+     */
+    template <typename Signature>
+    class Callback;
+
+    template <typename Result, typename... Args>
+    class Callback<Result(Args...)>
+    {
+    public:
+        Callback() = default;
+        Callback(std::nullptr_t) {}
+        Callback(Result (*function)(Args...)) : function(function) {}
+        Callback(Result (*function)(void *context, Args...), void *context) : contextFunction(function), context(context) {}
+
+        template <typename Lambda, typename = std::enable_if_t<std::is_convertible_v<Lambda, Result (*)(Args...)>>>
+        Callback(Lambda lambda) : function(lambda) {}
+
+        Result operator()(Args... args) const { return contextFunction ? contextFunction(context, args...) : function(args...); }
+        explicit operator bool() const { return function || contextFunction; }
+
+    private:
+        Result (*function)(Args...) = nullptr;                // Function called without a context.
+        Result (*contextFunction)(void *, Args...) = nullptr; // Function called with the context.
+        void *context = nullptr;                              // Context passed to the function.
+    };
+
+    // Embedded Builds Use Callbacks And Static Storage
+    template <typename Signature>
+    using Function = Callback<Signature>;
+    template <typename T>
+    using Allocator = StaticAllocator<T>;
+#else
+    template <typename Signature>
+    using Function = std::function<Signature>;
+    template <typename T>
+    using Allocator = std::allocator<T>;
+#endif
+
+    // Container Types
+    using String = std::basic_string<char, std::char_traits<char>, Allocator<char>>;
+    using Bytes = std::vector<uint8_t, Allocator<uint8_t>>;
+    template <typename T>
+    using Vector = std::vector<T, Allocator<T>>;
+
     // Function Types For Flash Access
-    using FlashWriteFunction = std::function<bool(uint32_t flashAddress, const uint8_t *data, size_t count)>;
-    using FlashReadFunction = std::function<bool(uint32_t flashAddress, uint8_t *data, size_t count)>;
-    using FlashEraseFunction = std::function<bool(uint32_t flashAddress, size_t count)>;
+    using FlashWriteFunction = Function<bool(uint32_t flashAddress, const uint8_t *data, size_t count)>;
+    using FlashReadFunction = Function<bool(uint32_t flashAddress, uint8_t *data, size_t count)>;
+    using FlashEraseFunction = Function<bool(uint32_t flashAddress, size_t count)>;
+
+    // Optional Function Types For Asynchronous Erase With Suspend/Resume
+    using FlashEraseStartFunction = Function<bool(uint32_t flashAddress, size_t count)>;
+    using FlashBusyFunction = Function<bool()>;
+    using FlashSuspendFunction = Function<bool()>;
+    using FlashResumeFunction = Function<bool()>;
+
+    // Optional Function Types For Grouping Flash Writes Into Exclusive Sections
+    using FlashBeginExclusiveFunction = Function<bool()>;
+    using FlashEndExclusiveFunction = Function<void()>;
+
+    // Function Type For A Monotonic Clock In Microseconds
+    using ClockFunction = Function<uint64_t()>;
+
+    /**
+     * @struct FlashCapabilities
+     * @brief Optional features implemented by a FlashDriver.
+     */
+    struct FlashCapabilities
+    {
+        bool blankCheck = false;                     // Whether blankCheck() is implemented.
+        bool asyncErase = false;                     // Whether eraseStart(), busy(), suspend() and resume() are implemented.
+        bool vectoredRead = false;                   // Whether readVector() is cheaper than the same reads made separately.
+        size_t programSize = 0;                      // Smallest unit that can be programmed, or 0 for the page size. Records are aligned to it, so it must not change for an existing map.
+        uint8_t erasedValue = FLASHKV_ERASED_VALUE;  // Value of erased bytes. Parts that erase to another value are inverted transparently.
+        size_t maxTransferSize = 0;                  // Largest read or program in one call, or 0 to program a page at a time and read without limit.
+        size_t eraseBlockSize = 0;                   // Size of a multi-sector block erase, or 0 if only sectors can be erased.
+    };
+
+    /**
+     * @struct FlashReadRequest
+     * @brief One of the reads performed by FlashDriver::readVector().
+     */
+    struct FlashReadRequest
+    {
+        uint32_t flashAddress; // Address to read from.
+        uint8_t *data;         // Buffer to read into.
+        size_t count;          // Number of bytes to read.
+    };
+
+    /**
+     * @class FlashDriver
+     * @brief Interface to the Flash memory used by FlashKV.
+     *
+     * Drivers must implement read(), program() and erase(), and report any of the optional methods they implement
+     * through capabilities(). Every method returns true on success. FlashKV never owns or deletes a driver, so drivers
+     * cannot be deleted through this interface either.
+     */
+    class FlashDriver
+    {
+    public:
+        /**
+         * @brief Reads data from Flash memory.
+         */
+        virtual bool read(uint32_t flashAddress, uint8_t *data, size_t count) = 0;
+
+        /**
+         * @brief Programs whole pages of Flash memory.
+         */
+        virtual bool program(uint32_t flashAddress, const uint8_t *data, size_t count) = 0;
+
+        /**
+         * @brief Erases whole sectors of Flash memory, waiting for the erase to finish.
+         */
+        virtual bool erase(uint32_t flashAddress, size_t count) = 0;
+
+        /**
+         * @brief Reports the optional methods implemented by the driver.
+         */
+        virtual FlashCapabilities capabilities() const { return {}; }
+
+        /**
+         * @brief Checks that Flash memory is erased without transferring its contents.
+         *
+         * @return Whether every byte is erased, or std::nullopt if the check failed.
+         */
+        virtual std::optional<bool> blankCheck(uint32_t, size_t) { return std::nullopt; }
+
+        /**
+         * @brief Performs several reads in one request.
+         */
+        virtual bool readVector(const FlashReadRequest *requests, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+                if (!read(requests[i].flashAddress, requests[i].data, requests[i].count))
+                    return false;
+
+            return true;
+        }
+
+        /**
+         * @brief Starts erasing whole sectors of Flash memory and returns immediately.
+         */
+        virtual bool eraseStart(uint32_t, size_t) { return false; }
+
+        /**
+         * @brief Checks whether an erase started by eraseStart() is still in progress.
+         */
+        virtual bool busy() { return false; }
+
+        /**
+         * @brief Suspends an in-progress erase so Flash memory can be read.
+         */
+        virtual bool suspend() { return false; }
+
+        /**
+         * @brief Resumes a suspended erase.
+         */
+        virtual bool resume() { return false; }
+
+        /**
+         * @brief Enters a section in which program() and erase() may be called.
+         *
+         * Parts whose writes require pausing other cores or disabling execute-in-place can do so once here rather
+         * than in every call. FlashKV issues the programs and erases of a commit back to back inside one section and
+         * never reads Flash memory inside it. An erase started with eraseStart() by maintenance() is still running
+         * when endExclusive() is called.
+         */
+        virtual bool beginExclusive() { return true; }
+
+        /**
+         * @brief Leaves the section entered by beginExclusive().
+         */
+        virtual void endExclusive() {}
+
+    protected:
+        // A Virtual Destructor Would Pull The Sized operator delete Into Builds Without A Heap
+        ~FlashDriver() = default;
+    };
+
+    /**
+     * @struct KeyEntry
+     * @brief In-memory state of a key in the map.
+     */
+    struct KeyEntry
+    {
+        Bytes value;                             // Current value of the key, starting at head.
+        std::atomic<uint32_t> version{0};        // Version stamp of the value, odd while it is being changed.
+        uint32_t location = FLASHKV_NO_LOCATION; // Offset of the latest record for the key in Flash memory.
+        uint32_t storedSize = 0;                 // Size of the latest record for the key in Flash memory.
+        uint32_t head = 0;                       // Bytes at the front of value trimmed away by appends but not yet released.
+        bool erased = false;                     // Whether the key has been erased.
+        bool dirty = false;                      // Whether the key needs a new record in Flash memory.
+        bool queued = false;                     // Whether the key is in the dirty list.
+        uint16_t appendedSize = 0;               // Bytes appended since the latest record, or 0 if the whole value must be written.
+        uint16_t appendLimit = 0;                // Size the value was trimmed to by those appends, or 0 if unbounded.
+
+        const uint8_t *data() const { return value.data() + head; } // Start of the current value.
+        size_t size() const { return value.size() - head; }         // Size of the current value.
+    };
 
     // Key-Value Map Types
-    using KeyValue = std::pair<std::string, std::vector<uint8_t>>;
-    using KeyValueMap = std::unordered_map<KeyValue::first_type, KeyValue::second_type>;
+    using KeyValue = std::pair<String, Bytes>;
+#ifdef FLASHKV_ORDERED_INDEX
+    using KeyValueMap = std::map<String, KeyEntry, std::less<String>, Allocator<std::pair<const String, KeyEntry>>>;
+#else
+    using KeyValueMap = std::unordered_map<String, KeyEntry, std::hash<std::string_view>, std::equal_to<String>, Allocator<std::pair<const String, KeyEntry>>>;
+#endif
+
+    /**
+     * @enum IoClass
+     * @brief Priority classes for background flash work, from highest to lowest priority.
+     *
+     * Foreground reads take precedence over all of them through suspendMaintenance().
+     */
+    enum class IoClass : uint8_t
+    {
+        Commit,     // Committing changes to Flash memory.
+        Compaction, // Reclaiming space in Flash memory.
+        Scrub,      // Verifying the contents of Flash memory.
+        Count
+    };
+
+    /**
+     * @struct Statistics
+     * @brief Counters describing the flash work performed by FlashKV.
+     */
+    struct Statistics
+    {
+        uint32_t commits;          // Commits completed.
+        uint32_t compactions;      // Sectors reclaimed by compaction.
+        uint32_t sectorErases;     // Sectors erased.
+        uint64_t bytesProgrammed;  // Bytes programmed.
+        uint32_t throttledCommits; // Commits deferred because the wear budget was exhausted.
+        uint32_t wearLevelMoves;   // Sectors of cold data moved by static wear levelling.
+        uint32_t commitErases;     // Sectors a commit had to erase before it could program them.
+        bool throttled;            // Whether changes are currently held in memory by the wear budget.
+    };
+
+    /**
+     * @struct SectorUsage
+     * @brief Space used in one sector of the key-value map region.
+     */
+    struct SectorUsage
+    {
+        bool used;           // Whether the sector holds records.
+        uint32_t eraseCount; // Number of times the sector has been erased.
+        size_t liveBytes;    // Bytes of records that are still the latest for their key.
+        size_t deadBytes;    // Bytes of superseded records and padding that compacting the sector would reclaim.
+    };
+
+    /**
+     * @struct RecoveryReport
+     * @brief Damage found and records salvaged by recoverMap().
+     */
+    struct RecoveryReport
+    {
+        uint32_t damagedSectors;   // Sectors with a corrupt header or corrupt records.
+        uint32_t corruptRecords;   // Places where a record could not be read and the scan resynchronised.
+        uint32_t recoveredRecords; // Records read from damaged sectors that a normal load would have missed or ignored.
+    };
+
+    /**
+     * @struct MemoryUsage
+     * @brief Approximate RAM used by the in-memory key-value map.
+     *
+     * Figures are derived from the container sizes and capacities and exclude any allocator bookkeeping overhead.
+     */
+    struct MemoryUsage
+    {
+        size_t indexBytes; // Bytes used by the hash table buckets and nodes.
+        size_t keyBytes;   // Bytes allocated for keys that do not fit in the small string buffer.
+        size_t valueBytes; // Bytes allocated for values.
+        size_t totalBytes; // Sum of the index, key and value bytes.
+    };
 
     /**
      * @class FlashKV
@@ -57,6 +393,14 @@ namespace FlashKV
      * FlashKV is a class that allows for storing, reading, and erasing key-value pairs in Flash memory.
      * It is designed to work with uint8_t keys and values.
      *
+     * The Flash memory region is used as a log of sectors. Each commit appends one checksummed record per changed
+     * key to the newest sector, and sectors are compacted once the region fills up. A region of a single sector
+     * is rewritten in place when full, which is not safe against power loss.
+     *
+     * Writes, loads, saves and maintenance() hold the map for the length of the call. One made while another holds
+     * it, such as from an interrupt handler or another core, fails at once instead of waiting, so every call either
+     * runs alone or does nothing. Of the reads, only readKeyInto() may overlap a write.
+     *
      * @note Ensure that the Flash memory is initialized and accessible before using this class.
      */
     class FlashKV
@@ -84,6 +428,25 @@ namespace FlashKV
                 size_t flashAddress,
                 size_t flashSize);
 
+        /**
+         * @brief Constructs a new FlashKV object on top of a Flash driver.
+         *
+         * @param flashDriver Driver for the Flash memory, which must outlive the FlashKV object.
+         * @param flashPageSize Minimum size required for writing data to Flash memory. Should be equal to Flash page size.
+         * @param flashSectorSize Minimum size required for erasing data from Flash memory. Should be equal to Flash sector size.
+         * @param flashAddress Starting address in Flash memory where key-value pairs will be stored.
+         * @param flashSize Size of Flash memory region reserved for key-value map. Should be large enough to accommodate required number of key-value pairs.
+         */
+        FlashKV(FlashDriver &flashDriver,
+                size_t flashPageSize,
+                size_t flashSectorSize,
+                size_t flashAddress,
+                size_t flashSize);
+
+        // The Dirty List Points Into The Map And The Driver May Point Into The Object, So Neither Can Be Copied
+        FlashKV(const FlashKV &) = delete;
+        FlashKV &operator=(const FlashKV &) = delete;
+
         /**
          * @brief Destroys the FlashKV object.
          *
@@ -94,19 +457,83 @@ namespace FlashKV
         /**
          * @brief Loads the key-value map from Flash memory.
          *
-         * @return 0 If an error occurred while loading the map.
-         * @return 1 If a map was successfully loaded from flash memory.
+         * @return 0 If an error occurred while loading the map, or another call held the map.
+         * @return 1 If a map was successfully loaded from flash memory, including one held only in the emergency journal.
          * @return 2 If no map was found in flash memory.
+         * @return 3 If a map was loaded, but intact records were skipped after a corrupt one. Call recoverMap() before
+         *         the next save or maintenance() to salvage them, as compaction may erase them.
+         *
+         * @note A map written by FlashKV 1.0 is converted by the next commit. Loading fails if it does not fit in the new format.
          */
         uint8_t loadMap();
 
+        /**
+         * @brief Loads the key-value map from Flash memory, salvaging every intact record from damaged sectors.
+         *
+         * Where loadMap() stops reading a sector at the first corrupt record and ignores sectors with a corrupt
+         * header, recoverMap() resynchronises on the next record with a valid checksum and reads damaged sectors as
+         * if they were the oldest. Recovered keys are committed to healthy sectors by the next save.
+         *
+         * @param report Filled in with the damage found and the records recovered.
+         *
+         * @return The same values as loadMap(), except 3.
+         *
+         * @note Records recovered from a damaged sector may bring back keys that were erased before the damage occurred.
+         */
+        uint8_t recoverMap(RecoveryReport &report);
+
         /**
          * @brief Saves the key-value map to Flash memory.
          *
-         * @return True if the save operation was successful, false otherwise.
+         * Only keys written or erased since the last save are appended to Flash memory, one record per key.
+         *
+         * @return True if every change is in Flash memory, false if writing failed, another call held the map, or the
+         * commit was deferred by the wear budget set with setWearBudget(). Statistics::throttled is set only in the
+         * last case, where the changes are kept in memory for a later save or maintenance().
          */
         bool saveMap();
 
+        /**
+         * @brief Reserves the last sectors of the region as a journal for emergencyFlush().
+         *
+         * The journal is kept erased, so a flush only programs. Call this before loadMap(), and only on a region that
+         * has always been used with the same journal size, since any map data in the reserved sectors is discarded.
+         *
+         * @param sectorCount The number of sectors to reserve, or 0 for no journal.
+         *
+         * @return True if the journal was reserved, false if it would leave no sectors for the map.
+         */
+        bool setEmergencyJournal(size_t sectorCount);
+
+        /**
+         * @brief Writes every change not yet in Flash memory to the emergency journal.
+         *
+         * Meant for the hold-up time left after a power failure is detected. Nothing is erased, compacted or
+         * allocated; the pending changes are programmed one program unit at a time after the previous flushes.
+         * loadMap() replays the journal, and it is erased once its changes have been committed normally. With no
+         * pending changes nothing is programmed.
+         *
+         * @return True if every pending change was written, false if the journal is full, not reserved, another call
+         *         held the map, or an asynchronous erase is in progress.
+         */
+        bool emergencyFlush();
+
+        /**
+         * @brief Keeps a copy of the map in memory that survives warm resets, such as a no-init RAM section.
+         *
+         * Whenever commits to Flash memory have finished, the map and the state of every sector are copied into the
+         * buffer behind a header with a checksum and a generation number. After a warm reset, loadMap() mounts from a
+         * valid copy after reading only the active sector's header and its next program unit, which must still match
+         * the copy, and the headers of the sectors the copy holds as unused, none of which may have been opened since.
+         * The copy is invalidated before every Flash operation, so it never describes contents that Flash
+         * memory has moved past. maintenance() takes the copy as a step of its own within the time budget. Call this
+         * before loadMap(), without clearing the buffer.
+         *
+         * @param buffer The retained buffer, or nullptr to stop keeping a copy.
+         * @param size The size of the buffer in bytes. Maps that do not fit are always loaded from Flash memory.
+         */
+        void setRetainedMemory(void *buffer, size_t size);
+
         /**
          * @brief Writes a key-value pair to the map.
          *
@@ -115,7 +542,20 @@ namespace FlashKV
          *
          * @return True if the write operation was successful, false otherwise.
          */
-        bool writeKey(std::string key, std::vector<uint8_t> value);
+        bool writeKey(const String &key, const Bytes &value);
+
+        /**
+         * @brief Writes a key-value pair to the map from a raw buffer.
+         *
+         * @param key The key to be written. Keys starting with a NUL character are reserved for queues and rejected.
+         * @param data Pointer to the value to be associated with the key.
+         * @param size Size of the value in bytes.
+         *
+         * @return True if the write operation was successful, false otherwise.
+         *
+         * @note In bounded latency mode only existing keys can be written, and the value is copied in place without allocating.
+         */
+        bool writeKey(const String &key, const uint8_t *data, size_t size);
 
         /**
          * @brief Reads a value associated with a key from the map.
@@ -124,39 +564,756 @@ namespace FlashKV
          *
          * @return The value associated with the key if the read operation was successful, std::nullopt otherwise.
          */
-        std::optional<std::vector<uint8_t>> readKey(std::string key);
+        std::optional<Bytes> readKey(const String &key);
+
+        /**
+         * @brief Reads a value associated with a key into a caller-provided buffer without allocating.
+         *
+         * @param key The key to be read.
+         * @param buffer Buffer to copy the value into.
+         * @param bufferSize Size of the buffer in bytes.
+         *
+         * @return The size of the value if the key was found and fits in the buffer, std::nullopt otherwise.
+         *
+         * @note While bounded latency mode is enabled this can be called from an interrupt handler or another core
+         * during writes. It never allocates or waits: the copy is checked against the entry's version, and if the key
+         * is being changed in every attempt, such as by the code the interrupt preempted, std::nullopt is returned.
+         * Construct the key outside the handler.
+         */
+        std::optional<size_t> readKeyInto(const String &key, uint8_t *buffer, size_t bufferSize);
+
+        /**
+         * @brief Reads a value into a caller-provided buffer along with its version.
+         *
+         * @param key The key to be read.
+         * @param buffer Buffer to copy the value into.
+         * @param bufferSize Size of the buffer in bytes.
+         * @param version Set to the version of the value that was copied, for a later compareExchange().
+         *
+         * @return The size of the value if the key was found and fits in the buffer, std::nullopt otherwise.
+         */
+        std::optional<size_t> readKeyInto(const String &key, uint8_t *buffer, size_t bufferSize, uint32_t &version);
+
+        /**
+         * @brief Atomically replaces a value only if it currently equals an expected value.
+         *
+         * The comparison and the write happen in place in the map, without copying the current value out, and the
+         * map is held from one to the other, so no other write can change the value in between.
+         *
+         * @param key The key to be updated. A missing or erased key never matches.
+         * @param expected The value the key must currently hold.
+         * @param desired The value to write if it does.
+         *
+         * @return True if the value was replaced, false if it did not match, another call held the map, or the
+         * value could not be written.
+         */
+        bool compareExchange(const String &key, const Bytes &expected, const Bytes &desired);
+
+        /**
+         * @brief Atomically replaces a value only if it has not changed since it was read.
+         *
+         * Every change gives the value a new version from a counter shared by the whole map, which carries on
+         * across reloads and keys being erased and written again, so a version never repeats for the lifetime of
+         * this object. A caller can read a value with readKeyInto(), work on its copy, and write the result back
+         * only if no other write to the key happened in between, such as one from an interrupt handler or another
+         * core. The version is checked while the map is held, so no write can slip in after the check.
+         *
+         * @param key The key to be updated. A missing or erased key never matches.
+         * @param expectedVersion The version returned when the value was read.
+         * @param desired The value to write if the version still matches.
+         *
+         * @return True if the value was replaced, false if it changed, another call held the map, or the value could
+         * not be written.
+         */
+        bool compareExchange(const String &key, uint32_t expectedVersion, const Bytes &desired);
+
+        /**
+         * @brief Appends data to the end of a value.
+         *
+         * Only the appended bytes are committed, as a small append record following the key's latest record, until
+         * its sector fills up and the whole value is written again. With a maximum size the oldest bytes are dropped
+         * once the value exceeds it, so appending fixed-size entries with maxSize a multiple of the entry size keeps
+         * the latest maxSize / entrySize entries as a ring buffer. Dropped bytes are skipped over rather than moved
+         * out of the way, so an append takes time in proportion to the data appended, on average. Compaction writes
+         * only the entries still kept.
+         *
+         * @param key The key to append to. A missing or erased key is created holding just the data. Keys starting
+         * with a NUL character are reserved for queues and rejected.
+         * @param data Pointer to the data to append.
+         * @param size Size of the data in bytes.
+         * @param maxSize Largest size the value is kept to, or 0 for no limit.
+         *
+         * @return True if the data was appended, false otherwise.
+         */
+        bool appendToKey(const String &key, const uint8_t *data, size_t size, size_t maxSize = 0);
+
+        /**
+         * @brief Appends data to the end of a value.
+         *
+         * @param key The key to append to.
+         * @param data The data to append.
+         * @param maxSize Largest size the value is kept to, or 0 for no limit.
+         *
+         * @return True if the data was appended, false otherwise.
+         */
+        bool appendToKey(const String &key, const Bytes &data, size_t maxSize = 0);
+
+        /**
+         * @brief Atomically adds to a numeric value in place.
+         *
+         * The value is stored as the native representation of T. A missing or erased key counts from zero. The map
+         * is held from the read to the write, so an addition is never lost to a concurrent one: whichever call finds
+         * the map held fails instead.
+         *
+         * @param key The key holding the value.
+         * @param delta The amount to add.
+         *
+         * @return The value before the addition, or std::nullopt if the key holds a value of a different size,
+         * another call held the map, or the result could not be written.
+         */
+        template <typename T>
+        std::optional<T> fetchAdd(const String &key, T delta)
+        {
+            static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "fetchAdd() needs a numeric type");
+
+            WriteGuard guard(writing);
+            if (!guard || reservedKey(key))
+                return std::nullopt;
+
+            auto it = keyValueMap.find(key);
+            T previous{};
+            if (it != keyValueMap.end() && !it->second.erased)
+            {
+                if (it->second.size() != sizeof(T))
+                    return std::nullopt;
+
+                std::memcpy(&previous, it->second.data(), sizeof(T));
+            }
+
+            T updated = static_cast<T>(previous + delta);
+            uint8_t bytes[sizeof(T)];
+            std::memcpy(bytes, &updated, sizeof(T));
+            if (!storeValue(key, it, bytes, sizeof(T)))
+                return std::nullopt;
+
+            return previous;
+        }
 
         /**
          * @brief Erases a key-value pair from the map.
          *
-         * @param key The key to be erased. Should be a uint8_t value.
+         * @param key The key to be erased. Keys starting with a NUL character are reserved for queues and rejected.
          *
          * @return True if the erase operation was successful, false otherwise.
          */
-        bool eraseKey(std::string key);
+        bool eraseKey(const String &key);
 
         /**
          * @brief Gets all keys in the map.
          *
+         * Keys starting with a NUL character are reserved for queues and are not listed.
+         *
          * @return An std::vector of all keys in the map.
          */
-        std::vector<std::string> getAllKeys();
+        Vector<String> getAllKeys();
+
+        /**
+         * @brief Adds an entry to the back of a persistent queue.
+         *
+         * Each entry is stored under its own hidden key, and the queue's head and tail are kept together in one
+         * small record, so pushing and popping never scan the map. In bounded latency mode entries cannot be pushed,
+         * since each one creates a key.
+         *
+         * @param queue The name of the queue, which must not contain a NUL character.
+         * @param data Pointer to the entry.
+         * @param size Size of the entry in bytes.
+         *
+         * @return True if the entry was queued, false otherwise.
+         */
+        bool pushToQueue(const String &queue, const uint8_t *data, size_t size);
+
+        /**
+         * @brief Adds an entry to the back of a persistent queue.
+         *
+         * @param queue The name of the queue.
+         * @param data The entry.
+         *
+         * @return True if the entry was queued, false otherwise.
+         */
+        bool pushToQueue(const String &queue, const Bytes &data);
+
+        /**
+         * @brief Removes the entry at the front of a persistent queue.
+         *
+         * The entry's key is erased without a deletion record: moving the head past it is what removes it, and
+         * loadMap() discards entries behind the head. If power is lost before the head reaches Flash memory the
+         * entry may be popped again, so consumers should tolerate repeats.
+         *
+         * @param queue The name of the queue.
+         *
+         * @return The entry, or std::nullopt if the queue is empty or its head could not be moved, in which case the
+         * entry is left in the queue.
+         */
+        std::optional<Bytes> popFromQueue(const String &queue);
+
+        /**
+         * @brief Reads the entry at the front of a persistent queue without removing it.
+         *
+         * @param queue The name of the queue.
+         *
+         * @return The entry, or std::nullopt if the queue is empty.
+         */
+        std::optional<Bytes> peekQueue(const String &queue);
+
+        /**
+         * @brief Gets the number of entries in a persistent queue.
+         *
+         * Each entry between the head and tail is looked up, so entries skipped after a power loss or dropped by
+         * recoverMap() are not counted.
+         *
+         * @param queue The name of the queue.
+         *
+         * @return The number of entries that can still be popped.
+         */
+        size_t getQueueLength(const String &queue);
+
+        /**
+         * @brief Reserves space in the in-memory map for a number of keys.
+         *
+         * Reserving up front avoids rehashing the map as keys are inserted. loadMap() sizes the map from the key
+         * count stored in the newest sector header, so calling this first is only needed for keys the map is
+         * expected to grow to after loading.
+         *
+         * @param keyCount The number of keys to reserve space for.
+         */
+        void reserve(size_t keyCount);
+
+        /**
+         * @brief Reports the RAM used by the in-memory map.
+         *
+         * @return The index, key and value bytes currently allocated.
+         */
+        MemoryUsage memoryUsage() const;
+
+        /**
+         * @brief Sets the clock used to time flash operations during maintenance.
+         *
+         * @param clockFunction Function returning a monotonic time in microseconds.
+         */
+        void setClockFunction(ClockFunction clockFunction);
+
+        /**
+         * @brief Enables bounded latency mode for real-time callers.
+         *
+         * The map is pre-sized for maxKeys and every value is given capacity for maxValueSize bytes, so that
+         * writeKey() and readKeyInto() never allocate or rehash. While enabled, new keys cannot be created and values
+         * larger than maxValueSize, or than the capacity a value was given, are rejected. Loading the map while enabled
+         * gives every loaded value the same capacity again. Flash work is left to maintenance(), whose commit buffer and
+         * operation queues are sized for a full sector of changes plus every key, so it never allocates either.
+         * Erased keys keep their place in the index until the mode is disabled, so readKeyInto() can run concurrently.
+         *
+         * @note Keys are looked up in a hash table, which takes constant time on average but degrades with collisions;
+         * the worst case is linear in the number of keys. Build with FLASHKV_ORDERED_INDEX for logarithmic lookups.
+         *
+         * @param maxKeys The maximum number of keys the map will hold.
+         * @param maxValueSize The maximum size of any value in bytes.
+         *
+         * @return True if bounded latency mode was enabled, false if the map already exceeds the given limits.
+         */
+        bool enableBoundedLatency(size_t maxKeys, size_t maxValueSize);
+
+        /**
+         * @brief Disables bounded latency mode.
+         */
+        void disableBoundedLatency();
+
+        /**
+         * @brief Performs pending flash work within a time budget.
+         *
+         * Changes made since the last save are committed to Flash memory one page program or sector erase at a time.
+         * An operation is only started if its worst observed duration fits in the remaining budget, so the call
+         * returns within the budget once every operation type has been timed. Without a clock function, a single
+         * operation is performed per call.
+         *
+         * @param budgetMicros The time budget for this call in microseconds.
+         *
+         * @return 0 If an error occurred while writing to flash memory.
+         * @return 1 If all changes have been committed to flash memory.
+         * @return 2 If flash work remains pending, the copy of the map for setRetainedMemory() is still to be taken, or
+         *         another call held the map.
+         *
+         * @note Serialising a new commit happens in the first call after a change and is proportional to the number of changed keys.
+         */
+        uint8_t maintenance(uint64_t budgetMicros);
+
+        /**
+         * @brief Sets the number of erased sectors maintenance() keeps ready for commits.
+         *
+         * Sectors are compacted before the pool runs out, and maintenance() erases compacted, unreadable and
+         * fully superseded sectors while no commit is pending, so commits only program. saveMap() leaves these erases
+         * to maintenance() unless it needs the space itself.
+         *
+         * @param sectorCount The number of erased sectors to keep, or 0 to erase compacted sectors during saveMap().
+         *
+         * @note Each sector in the pool is unavailable for records, so keep it well below the number of sectors.
+         */
+        void setErasedPool(size_t sectorCount);
+
+        /**
+         * @brief Sets optional functions for erasing asynchronously with suspend/resume support.
+         *
+         * When set, maintenance() starts sector erases without waiting for them and polls for completion on later
+         * calls, and an in-progress erase is suspended whenever Flash memory has to be read.
+         *
+         * @param flashEraseStartFunction Function that starts erasing data from Flash memory and returns immediately.
+         * @param flashBusyFunction Function that returns true while an erase is in progress.
+         * @param flashSuspendFunction Function that suspends an in-progress erase.
+         * @param flashResumeFunction Function that resumes a suspended erase.
+         *
+         * @note Only applies to FlashKV objects constructed from functions. Drivers report asynchronous erase through
+         *       their capabilities instead.
+         */
+        void setEraseSuspendFunctions(FlashEraseStartFunction flashEraseStartFunction,
+                                      FlashBusyFunction flashBusyFunction,
+                                      FlashSuspendFunction flashSuspendFunction,
+                                      FlashResumeFunction flashResumeFunction);
+
+        /**
+         * @brief Sets optional functions bracketing each group of Flash writes.
+         *
+         * On parts where programming or erasing requires pausing the other core and disabling execute-in-place, the
+         * lockout is paid once per group instead of once per call. Each commit issues its programs and erases inside
+         * one section, and maintenance() keeps a section open across the operations it runs in one call.
+         *
+         * @param flashBeginExclusiveFunction Function that enters the section, returning false if it cannot.
+         * @param flashEndExclusiveFunction Function that leaves the section.
+         *
+         * @note Only applies to FlashKV objects constructed from functions. Drivers implement
+         *       FlashDriver::beginExclusive() and FlashDriver::endExclusive() instead.
+         */
+        void setExclusiveFunctions(FlashBeginExclusiveFunction flashBeginExclusiveFunction,
+                                   FlashEndExclusiveFunction flashEndExclusiveFunction);
+
+        /**
+         * @brief Suspends background flash work so Flash memory can be read.
+         *
+         * Any in-progress asynchronous erase is suspended and maintenance() starts no new operations until
+         * resumeMaintenance() is called. Calls may be nested.
+         *
+         * @return True if Flash memory is readable, false if the erase could not be suspended.
+         */
+        bool suspendMaintenance();
+
+        /**
+         * @brief Resumes background flash work suspended by suspendMaintenance().
+         *
+         * @return True if the resume was successful, false otherwise.
+         */
+        bool resumeMaintenance();
+
+        /**
+         * @brief Reads from Flash memory, suspending any in-progress erase for the duration of the read.
+         *
+         * @param flashAddress Address in Flash memory to read from.
+         * @param data Buffer to read into.
+         * @param count Number of bytes to read.
+         *
+         * @return True if the read was successful, false otherwise.
+         */
+        bool priorityRead(uint32_t flashAddress, uint8_t *data, size_t count);
+
+        /**
+         * @brief Limits the rate at which maintenance() performs work of a given class.
+         *
+         * @param ioClass The class of work to limit.
+         * @param bytesPerSecond The maximum number of bytes erased, programmed or read per second, or 0 for no limit.
+         *
+         * @note Rate limits require a clock function.
+         */
+        void setRateLimit(IoClass ioClass, size_t bytesPerSecond);
+
+#ifndef FLASHKV_NO_SCRUB
+        /**
+         * @brief Starts verifying the map in Flash memory against the in-memory map.
+         *
+         * The verification runs in the background through maintenance() once pending commits have finished. Any
+         * mismatch causes the affected keys to be rewritten by the next commit.
+         */
+        void scrubMap();
+#endif
+
+        /**
+         * @brief Limits the flash wear caused by commits, compaction and wear levelling over a time window.
+         *
+         * Once committing would exceed either limit within the current window, saveMap() and maintenance() keep
+         * changes in memory and commit them together once the next window starts. A commit is charged for the sector
+         * it may have to erase and for any compaction or wear levelling move it triggers, and the erases maintenance()
+         * runs for compaction and the erased pool wait for the next window in the same way. At least one commit is
+         * allowed per window so changes are never held back indefinitely. A deferred saveMap() returns false with
+         * Statistics::throttled set, and maintenance() returns 2.
+         *
+         * @param maxErases The maximum number of sector erases per window, or 0 for no limit.
+         * @param maxBytesProgrammed The maximum number of bytes programmed per window, or 0 for no limit.
+         * @param windowMicros The length of the window in microseconds.
+         *
+         * @return True if the budget was set, false if a limit was given before setClockFunction(), since windows
+         * cannot be timed without a clock. Passing 0 for both limits always removes the budget.
+         */
+        bool setWearBudget(uint32_t maxErases, size_t maxBytesProgrammed, uint64_t windowMicros);
+
+        /**
+         * @brief Sets how far erase counts may drift apart before cold data is moved.
+         *
+         * Sectors holding keys that never change are otherwise never compacted, so their erase counts stay low while
+         * the rest of the region wears out. Once the least worn sector holding records falls more than maxEraseSkew
+         * erases behind the most worn sector, the next compaction moves its records into a worn sector and returns it
+         * to the pool used for new writes.
+         *
+         * @param maxEraseSkew The largest erase count gap allowed, or 0 to disable static wear levelling.
+         */
+        void setWearLevelling(uint32_t maxEraseSkew);
+
+        /**
+         * @brief Gets counters describing the flash work performed so far.
+         *
+         * @return The current statistics.
+         */
+        Statistics getStatistics() const;
+
+        /**
+         * @brief Gets the live and dead bytes held by each sector.
+         *
+         * Compaction picks the sector with the best ratio of reclaimed space to copying cost, weighted by age.
+         *
+         * @return The usage of every sector in the region, in address order.
+         */
+        Vector<SectorUsage> getSectorUsage() const;
+
+#ifdef FLASHKV_PARALLEL_LOAD
+        /**
+         * @brief Sets the number of threads used by loadMap() to read sectors.
+         *
+         * Sectors are parsed concurrently and then merged in sequence order, so the loaded map is the same as with a
+         * single thread.
+         *
+         * @param threadCount The number of threads to use, or 1 to load on the calling thread.
+         *
+         * @note The Flash read function, or the read and blank check methods of the driver, must be safe to call from
+         *       several threads at once.
+         */
+        void setLoadThreads(size_t threadCount);
+#endif
 
     private:
-        FlashWriteFunction flashWriteFunction; // Function for writing to Flash memory.
-        FlashReadFunction flashReadFunction;   // Function for reading from Flash memory.
-        FlashEraseFunction flashEraseFunction; // Function for erasing from Flash memory.
-
-        std::vector<uint8_t> serialiseKeyValuePair(const std::string &key, const std::vector<uint8_t> &value); // Serialises A Key-Value Pair.
-        std::optional<std::pair<size_t, KeyValue>> deserialiseKeyValuePair(size_t offset);                     // Deserialises A Key-Value Pair.
-        bool verifySignature();                                                                                // Verifies The FlashKV Signature.
-
-        KeyValueMap keyValueMap;                        // In-memory key-value map.
-        size_t flashPageSize;                           // Size of a page in Flash memory.
-        size_t flashSectorSize;                         // Size of a sector in Flash memory.
-        size_t flashAddress;                            // Address of the Flash memory to use for the key-value map.
-        size_t flashSize;                               // Size of the Flash memory to use for the key-value map.
-        size_t serialisedSize = FLASHKV_SIGNATURE_SIZE; // Size of the serialised key-value map.
+        /**
+         * @class CallbackDriver
+         * @brief Driver calling the functions given to the function-based constructor.
+         */
+        class CallbackDriver final : public FlashDriver
+        {
+        public:
+            bool read(uint32_t flashAddress, uint8_t *data, size_t count) override;
+            bool program(uint32_t flashAddress, const uint8_t *data, size_t count) override;
+            bool erase(uint32_t flashAddress, size_t count) override;
+            FlashCapabilities capabilities() const override;
+            bool eraseStart(uint32_t flashAddress, size_t count) override;
+            bool busy() override;
+            bool suspend() override;
+            bool resume() override;
+            bool beginExclusive() override;
+            void endExclusive() override;
+
+            FlashWriteFunction flashWriteFunction; // Function for writing to Flash memory.
+            FlashReadFunction flashReadFunction;   // Function for reading from Flash memory.
+            FlashEraseFunction flashEraseFunction; // Function for erasing from Flash memory.
+
+            FlashEraseStartFunction flashEraseStartFunction; // Function for starting an asynchronous erase.
+            FlashBusyFunction flashBusyFunction;             // Function for polling an asynchronous erase.
+            FlashSuspendFunction flashSuspendFunction;       // Function for suspending an asynchronous erase.
+            FlashResumeFunction flashResumeFunction;         // Function for resuming an asynchronous erase.
+
+            FlashBeginExclusiveFunction flashBeginExclusiveFunction; // Function for entering an exclusive section.
+            FlashEndExclusiveFunction flashEndExclusiveFunction;     // Function for leaving an exclusive section.
+        };
+
+        CallbackDriver callbackDriver;        // Driver used when constructed from functions.
+        FlashDriver *driver;                  // Driver for the Flash memory.
+        FlashCapabilities driverCapabilities; // Optional features of the driver.
+        ClockFunction clockFunction;          // Function for reading the current time.
+
+        /**
+         * @struct FlashOperation
+         * @brief A single sector erase or page program issued by a commit or compaction.
+         */
+        struct FlashOperation
+        {
+            enum class Type : uint8_t
+            {
+                Erase,
+                Program
+            };
+
+            Type type;           // Kind of flash operation.
+            size_t offset;       // Offset into the key-value map region.
+            size_t size;         // Number of bytes erased or programmed.
+            size_t bufferOffset; // Offset of the data to program in the commit buffer.
+        };
+
+        /**
+         * @struct RetainedHeader
+         * @brief Header of the copy of the map kept in retained memory.
+         */
+        struct RetainedHeader
+        {
+            uint8_t signature[4];     // Set once the copy is complete.
+            uint32_t crc;             // Checksum of the rest of the header and the copy.
+            uint32_t generation;      // Number of copies taken since the map was read from Flash memory.
+            uint8_t result;           // Value loadMap() returns for the map.
+            size_t size;              // Size of the copy after the header.
+            size_t flashAddress;      // Address of the region the copy describes.
+            size_t flashSize;         // Size of the region the copy describes.
+            size_t sectorCount;       // Number of sectors holding the map.
+            size_t programSize;       // Program unit the sector offsets are aligned to.
+            size_t keyCount;          // Number of keys in the copy.
+            size_t activeSector;      // Sector records are appended to, if any.
+            uint32_t nextSequence;    // Sequence number for the next sector opened.
+            size_t journalOffset;     // Region offset the next emergency flush writes to.
+            uint32_t journalSequence; // Sequence of the newest sector the journal's changes follow.
+            bool journalUsed;         // Whether the journal holds anything that has not been erased.
+        };
+
+        /**
+         * @struct IoQueue
+         * @brief Pending flash operations and rate limiting state for one class of background work.
+         */
+        struct IoQueue
+        {
+            Vector<FlashOperation> operations;      // Pending flash operations.
+            size_t nextOperation = 0;               // Index of the next operation to perform.
+            size_t bytesPerSecond = 0;              // Rate limit, or zero for no limit.
+            int64_t tokens = 0;                     // Bytes the queue may transfer before it is throttled.
+            uint64_t lastRefill = 0;                // Time the tokens were last refilled.
+        };
+
+        /**
+         * @class WriteGuard
+         * @brief Holds the map for one call, or fails at once if another call already holds it.
+         */
+        class WriteGuard
+        {
+        public:
+            explicit WriteGuard(std::atomic_flag &flag) : flag(flag), held(!flag.test_and_set(std::memory_order_acquire)) {}
+
+            ~WriteGuard()
+            {
+                if (held)
+                    flag.clear(std::memory_order_release);
+            }
+
+            WriteGuard(const WriteGuard &) = delete;
+            WriteGuard &operator=(const WriteGuard &) = delete;
+
+            explicit operator bool() const { return held; }
+
+        private:
+            std::atomic_flag &flag; // Flag shared by every call that changes the map.
+            bool held;              // Whether this call set the flag.
+        };
+
+        /**
+         * @struct SectorInfo
+         * @brief In-memory state of a sector in the key-value map region.
+         */
+        struct SectorInfo
+        {
+            enum class State : uint8_t
+            {
+                Free,    // Erased and ready to be opened.
+                Garbage, // Holds nothing needed and must be erased before use.
+                Used,    // Holds records.
+                Erasing, // Queued for erasure by compaction.
+                Legacy   // Holds a map written by FlashKV 1.0.
+            };
+
+            State state = State::Garbage; // Current state of the sector.
+            uint32_t sequence = 0;        // Order in which the sector was opened.
+            uint32_t eraseCount = 0;      // Number of times the sector has been erased.
+            uint32_t keyCount = 0;        // Keys in the index when the sector was opened, or 0 if not recorded.
+            size_t writeOffset = 0;       // Offset of the next record to append.
+            size_t liveRecords = 0;       // Number of keys whose latest record is in the sector.
+            size_t liveBytes = 0;         // Size of the records counted in liveRecords.
+            bool damaged = false;         // Whether records were recovered from past corruption.
+            bool skipped = false;         // Whether loadMap() skipped intact records after a corrupt one.
+        };
+
+        enum class RecordType : uint8_t
+        {
+            Put = 1,
+            Delete = 2,
+            Append = 3 // Bytes added to the value of an earlier record for the key in the same sector.
+        };
+
+        enum class RecordStatus : uint8_t
+        {
+            Valid,
+            Blank,
+            Corrupt
+        };
+
+        /**
+         * @struct Record
+         * @brief A record read back from Flash memory.
+         */
+        struct Record
+        {
+            RecordStatus status; // Whether a valid record, erased Flash memory or corruption was found.
+            RecordType type;     // Kind of record.
+            size_t offset;       // Offset of the record in the key-value map region.
+            size_t size;         // Size of the record in Flash memory.
+            KeyValue keyValue;   // Key and value held by the record.
+        };
+
+        void fillRecordHeader(uint8_t *header, const String &key, const KeyEntry &entry) const;                // Fills In The Header And Checksum Of A Key's Record.
+        void serialiseKeyValuePair(const String &key, const KeyEntry &entry);                                  // Serialises A Key's Record Into The Commit Buffer.
+        void serialiseAppend(const String &key, const KeyEntry &entry);                                        // Serialises An Append Record Into The Commit Buffer.
+        std::optional<Record> deserialiseKeyValuePair(size_t offset, size_t limit);                            // Deserialises A Record.
+        bool readSectorHeader(size_t sector, const uint8_t *header);                                           // Classifies A Sector From Its Header, Reading It If Not Given.
+        uint8_t load(RecoveryReport *report);                                                                  // Loads The Map, Optionally Recovering Damaged Sectors.
+        bool parseSector(size_t sector, Vector<Record> &records, RecoveryReport *report);                      // Reads The Records In A Sector.
+        std::optional<size_t> findRecord(size_t offset, size_t limit);                                         // Finds The Next Valid Record.
+        bool loadSectors(const Vector<size_t> &order, RecoveryReport *report);                                 // Replays The Records In Used Sectors.
+        template <typename Task>
+        bool runParallel(size_t count, const Task &task);                                                      // Runs A Task For Each Index On The Load Threads.
+        std::optional<bool> isBlank(size_t offset, size_t count);                                              // Checks Flash Memory Is Erased.
+        void applyRecord(Record &record);                                                                      // Applies A Loaded Record To The Map.
+        void applyAppendRecord(Record &record);                                                                // Extends A Loaded Value With An Append Record.
+        void buildCommit();                                                                                    // Queues The Flash Operations For A Commit.
+        bool reserveSpace(size_t size);                                                                        // Makes Room For A Record In The Active Sector.
+        bool openSector();                                                                                     // Opens A New Active Sector.
+        size_t selectVictim(size_t room) const;                                                                // Picks The Sector Compaction Gains The Most From.
+        size_t movedSize(size_t sector) const;                                                                 // Bytes Moving A Sector's Keys Would Write.
+        size_t findColdSector() const;                                                                         // Finds A Sector Left Behind By Wear Levelling.
+        void fillErasedPool();                                                                                 // Queues Erases Of Reclaimable Sectors.
+        bool loadJournal();                                                                                    // Replays Changes Written By emergencyFlush().
+        void resetState();                                                                                     // Forgets The Loaded Map And Any Pending Work.
+        void retainSnapshot();                                                                                 // Copies The Committed Map Into Retained Memory.
+        bool snapshotDue() const;                                                                              // Whether A Retained Copy Should Be Taken.
+        std::optional<uint8_t> restoreSnapshot();                                                              // Mounts The Map From Retained Memory.
+        void invalidateSnapshot();                                                                             // Marks The Retained Copy Out Of Date.
+        bool enterExclusive();                                                                                 // Enters The Driver's Exclusive Section Once.
+        void leaveExclusive();                                                                                 // Leaves The Driver's Exclusive Section If Entered.
+        void applyJournalRecord(Record &record, uint32_t sequence);                                            // Applies A Journaled Change Unless The Log Has A Newer One.
+        bool writeJournal(size_t &offset, const uint8_t *data, size_t count);                                  // Programs Data Into The Journal A Unit At A Time.
+        void retireJournal();                                                                                  // Erases The Journal Once Its Changes Are Committed.
+        void retireDamaged();                                                                                  // Erases Recovered Sectors Once Their Keys Are Committed.
+        void collectSector(size_t sector);                                                                     // Moves Live Records Out Of A Sector.
+        void appendRecord(KeyValueMap::value_type &entry);                                                     // Appends The Record For A Key To The Commit.
+        size_t pendingRecordSize(const KeyValueMap::value_type &entry) const;                                  // Size Of The Record The Next Commit Writes For A Key.
+        void finishSegment();                                                                                  // Queues The Programs For The Current Sector.
+        void setLocation(KeyEntry &entry, uint32_t location, size_t size);                                     // Moves A Key To A New Record.
+        void markDirty(KeyValueMap::value_type &entry);                                                        // Queues A Key For The Next Commit.
+        void markSectorDirty(size_t sector);                                                                   // Queues Every Key Located In A Sector.
+        bool storeValue(const String &key, KeyValueMap::iterator it, const uint8_t *data, size_t size);        // Writes A Value Into A Key Found Or Missing From The Map.
+        bool eraseEntry(KeyValueMap::value_type &entry);                                                       // Erases A Key Found In The Map.
+        void appendValue(KeyEntry &entry, const uint8_t *data, size_t size, size_t limit);                     // Appends To A Value, Trimming It To A Limit.
+        bool memoryAvailable(const KeyEntry *entry, size_t keySize, size_t valueSize, bool appending) const;   // Checks That A Change Cannot Exhaust The Static Buffer.
+        bool reservedKey(const String &key) const;                                                             // Checks Whether A Key Is Reserved For Queues.
+        std::optional<std::pair<uint32_t, uint32_t>> readQueue(const String &queue) const;                     // Reads The Head And Tail Of A Queue.
+        bool writeQueue(const String &queue, uint32_t head, uint32_t tail);                                    // Writes The Head And Tail Of A Queue.
+        String queueEntryKey(const String &queue, uint32_t index) const;                                       // Names The Key Holding An Entry Of A Queue.
+        KeyValueMap::iterator findQueueFront(const String &queue, uint32_t &head, uint32_t tail);              // Finds The First Entry Still In A Queue.
+        void dropPoppedEntries();                                                                              // Discards Queue Entries Outside Their Queue.
+        void beginChange(KeyEntry &entry);                                                                     // Marks A Value As Being Changed For Concurrent Readers.
+        void endChange(KeyEntry &entry);                                                                       // Publishes A Changed Value To Concurrent Readers.
+        void stampVersions();                                                                                  // Gives Every Loaded Value A Version Not Used Before.
+        void reserveBounded();                                                                                 // Reserves The Capacity Bounded Latency Mode Writes Into.
+        size_t recordSize(size_t keySize, size_t valueSize) const;                                             // Size Of A Record In Flash Memory.
+        size_t capacity() const;                                                                               // Space Available For Live Records.
+        size_t alignToProgram(size_t offset) const;                                                            // Rounds An Offset Up To A Program Unit Boundary.
+        void queueErase(IoClass ioClass, size_t sector);                                                       // Queues A Sector Erase, Merging It Into A Block Erase Where Possible.
+        bool runOperation(const FlashOperation &operation);                                                    // Performs A Single Flash Operation.
+        void completeOperation(const FlashOperation &operation);                                               // Updates Sector State After An Operation.
+        bool runQueue(IoClass ioClass);                                                                        // Performs Every Operation In A Queue.
+        void abandonQueue(IoClass ioClass);                                                                    // Drops A Queue After A Failed Operation.
+        void finishErase();                                                                                    // Waits For An Asynchronous Erase.
+        bool readFlash(size_t offset, uint8_t *data, size_t count);                                            // Reads From The Key-Value Map Region.
+        bool programFlash(size_t offset, const uint8_t *data, size_t count);                                   // Programs The Key-Value Map Region.
+        void invertErased(uint8_t *data, size_t count) const;                                                  // Converts Between Stored And Logical Bytes.
+        bool hasWork(IoClass ioClass) const;                                                                   // Checks For Pending Work In A Class.
+        std::optional<IoClass> nextIoClass();                                                                  // Picks The Next Class Of Work To Run.
+        bool runStep(IoClass ioClass);                                                                         // Runs One Unit Of Work From A Class.
+        bool admitCommit();                                                                                    // Checks A Commit Against The Wear Budget.
+        bool withinWearBudget(uint32_t erases, size_t bytes);                                                  // Checks Flash Work Against The Current Wear Window.
+#ifndef FLASHKV_NO_SCRUB
+        size_t scrubStep();                                                                                    // Verifies One Record In Flash Memory.
+#endif
+#ifndef FLASHKV_NO_LEGACY_FORMAT
+        std::optional<std::pair<size_t, KeyValue>> deserialiseLegacyKeyValuePair(size_t offset);               // Deserialises A FlashKV 1.0 Key-Value Pair.
+        bool loadLegacyMap();                                                                                  // Loads A FlashKV 1.0 Map.
+        bool verifySignature();                                                                                // Verifies The FlashKV 1.0 Signature.
+#endif
+
+        KeyValueMap keyValueMap;   // In-memory key-value map.
+        size_t flashPageSize;      // Size of a page in Flash memory.
+        size_t programSize;        // Smallest unit programmed, which records are aligned to.
+        size_t flashSectorSize;    // Size of a sector in Flash memory.
+        size_t flashAddress;       // Address of the Flash memory to use for the key-value map.
+        size_t flashSize;          // Size of the Flash memory to use for the key-value map.
+        size_t serialisedSize = 0; // Size of the records for every key in the map.
+
+        Vector<SectorInfo> sectors;                            // State of each sector in the region.
+        size_t activeSector = SIZE_MAX;                        // Sector records are appended to, if any.
+        uint32_t nextSequence = 1;                             // Sequence number for the next sector opened.
+        Vector<KeyValueMap::value_type *> dirtyEntries;        // Keys waiting to be committed, oldest first.
+        size_t segmentStart = SIZE_MAX;                        // Buffer offset of the records for the active sector.
+        size_t segmentOffset = 0;                              // Region offset the active sector's records start at.
+        bool boundedLatency = false;                           // Whether bounded latency mode is enabled.
+        size_t maxKeys = 0;                                    // Keys reserved for in bounded latency mode.
+        size_t maxValueSize = 0;                               // Largest value accepted in bounded latency mode.
+        uint32_t versionStamp = 0;                             // Last version given to a value, shared by every key.
+        std::atomic_flag writing = ATOMIC_FLAG_INIT;           // Set while a call holds the map.
+        Bytes commitBuffer;                                    // Serialised records for the pending commit.
+        Bytes programBuffer;                                   // Inverted copy of a program for parts that erase to zero.
+        IoQueue ioQueues[static_cast<size_t>(IoClass::Count)]; // Background work by priority class.
+        uint64_t worstEraseMicros = 0;                         // Longest sector erase observed.
+        uint64_t worstProgramMicros = 0;                       // Longest page program observed.
+        uint64_t worstReadMicros = 0;                          // Longest scrub step observed.
+        uint64_t worstSnapshotMicros = 0;                      // Longest copy of the map into retained memory observed.
+#ifndef FLASHKV_NO_SCRUB
+        bool scrubActive = false;                              // Whether a scrub is in progress.
+        size_t scrubSector = 0;                                // Sector being verified.
+        size_t scrubOffset = 0;                                // Offset of the next record to verify.
+        size_t scrubRecords = 0;                               // Number of live records verified in the sector.
+        bool scrubHeaderChecked = false;                       // Whether the header of the sector has been verified.
+#endif
+#ifdef FLASHKV_PARALLEL_LOAD
+        size_t loadThreads = 1;                                // Number of threads used to read sectors in loadMap().
+#endif
+        bool eraseInProgress = false;                          // Whether an asynchronous erase has been started.
+        bool exclusive = false;                                // Whether the driver's exclusive section has been entered.
+        IoClass eraseClass = IoClass::Commit;                  // Class that started the asynchronous erase.
+        bool eraseSuspended = false;                           // Whether the asynchronous erase is suspended.
+        size_t suspendDepth = 0;                               // Number of outstanding suspendMaintenance() calls.
+        Statistics statistics{};                               // Counters describing the flash work performed.
+        uint32_t wearBudgetErases = 0;                         // Maximum sector erases per wear window.
+        size_t wearBudgetBytes = 0;                            // Maximum bytes programmed per wear window.
+        uint64_t wearWindowMicros = 0;                         // Length of the wear window.
+        uint64_t wearWindowStart = 0;                          // Time the current wear window started.
+        uint32_t wearWindowErases = 0;                         // Sector erases in the current wear window.
+        size_t wearWindowBytes = 0;                            // Bytes programmed in the current wear window.
+        uint32_t maxEraseSkew = FLASHKV_DEFAULT_ERASE_SKEW;    // Erase count gap that triggers static wear levelling.
+        size_t erasedPool = 0;                                 // Number of erased sectors maintenance() keeps ready.
+        size_t journalSectors = 0;                             // Number of sectors reserved for the emergency journal.
+        size_t journalOffset = 0;                              // Region offset the next emergency flush writes to.
+        uint32_t journalSequence = 0;                          // Sequence of the newest sector the journal's changes follow.
+        bool journalUsed = false;                              // Whether the journal holds anything that has not been erased.
+        bool journalErasing = false;                           // Whether erases of the journal are queued.
+        Bytes journalBuffer;                                   // Program unit being filled by an emergency flush.
+        uint8_t *retainedMemory = nullptr;                     // Buffer kept across warm resets for a copy of the map.
+        size_t retainedSize = 0;                               // Size of the retained buffer.
+        bool retainedCurrent = false;                          // Whether the retained copy matches Flash memory.
+        bool retainedUnfit = false;                            // Whether the map cannot be copied until Flash memory changes.
+        uint32_t retainedGeneration = 0;                       // Generation of the last retained copy.
     };
 
 } // namespace FlashKV
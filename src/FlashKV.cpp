@@ -28,9 +28,215 @@
 
 #include "../include/FlashKV/FlashKV.h"
 
+#include <algorithm>
+
+#ifdef FLASHKV_EMBEDDED
+#include <cstddef>
+#include <cstdlib>
+#endif
+
+#ifdef FLASHKV_PARALLEL_LOAD
+#include <atomic>
+#include <thread>
+#endif
+
+// Vector Kernels Are Used Where The Target Supports Them, Unless Compiled Out To Save Code Space
+#if !defined(FLASHKV_NO_SIMD) && defined(__AVX2__)
+#define FLASHKV_AVX2
+#include <immintrin.h>
+#elif !defined(FLASHKV_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define FLASHKV_SSE2
+#include <emmintrin.h>
+#elif !defined(FLASHKV_NO_SIMD) && defined(__ARM_NEON)
+#define FLASHKV_NEON
+#include <arm_neon.h>
+#endif
+
+// The Containers' Length Checks Call These, And The libstdc++ Versions Would Link In Exception Support, So Embedded
+// Builds Abort Instead. They Are Weak, So An Application's Own Definitions Take Precedence.
+#if defined(FLASHKV_EMBEDDED) && defined(__GLIBCXX__)
+namespace std
+{
+    __attribute__((weak)) void __throw_length_error(const char *) { std::abort(); }
+    __attribute__((weak)) void __throw_logic_error(const char *) { std::abort(); }
+}
+#endif
+
 namespace FlashKV
 {
 
+    // CRC-32 (IEEE 802.3), Computed A Nibble At A Time To Keep The Table Small
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+    {
+        static const uint32_t table[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                                           0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+            crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+        }
+
+        return ~crc;
+    }
+
+    // Checks That Every Byte Is Erased, A Vector At A Time Where The Target Supports It
+    static bool isErased(const uint8_t *data, size_t size)
+    {
+        size_t i = 0;
+#if defined(FLASHKV_AVX2)
+        const __m256i erased = _mm256_set1_epi8(static_cast<char>(FLASHKV_ERASED_VALUE));
+        for (; i + sizeof(__m256i) <= size; i += sizeof(__m256i))
+        {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, erased)) != -1)
+                return false;
+        }
+#elif defined(FLASHKV_SSE2)
+        const __m128i erased = _mm_set1_epi8(static_cast<char>(FLASHKV_ERASED_VALUE));
+        for (; i + sizeof(__m128i) <= size; i += sizeof(__m128i))
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, erased)) != 0xFFFF)
+                return false;
+        }
+#elif defined(FLASHKV_NEON)
+        const uint8x16_t erased = vdupq_n_u8(FLASHKV_ERASED_VALUE);
+        for (; i + sizeof(uint8x16_t) <= size; i += sizeof(uint8x16_t))
+        {
+            uint8x16_t equal = vceqq_u8(vld1q_u8(data + i), erased);
+            uint8x8_t folded = vand_u8(vget_low_u8(equal), vget_high_u8(equal));
+            if (vget_lane_u64(vreinterpret_u64_u8(folded), 0) != UINT64_MAX)
+                return false;
+        }
+#else
+        // Compare A Word At A Time
+        size_t erased;
+        std::memset(&erased, FLASHKV_ERASED_VALUE, sizeof(erased));
+        for (; i + sizeof(size_t) <= size; i += sizeof(size_t))
+        {
+            size_t word;
+            std::memcpy(&word, data + i, sizeof(size_t));
+            if (word != erased)
+                return false;
+        }
+#endif
+
+        for (; i < size; i++)
+            if (data[i] != FLASHKV_ERASED_VALUE)
+                return false;
+
+        return true;
+    }
+
+#ifdef FLASHKV_EMBEDDED
+    // -----------------------------------------    S T A T I C    M E M O R Y    ------------------------------------------ //
+
+    // Free Blocks Of The Static Buffer, Kept In Address Order So Neighbours Can Be Merged
+    struct StaticBlock
+    {
+        size_t size;       // Size of the block, including its header.
+        StaticBlock *next; // Next free block.
+    };
+
+    static StaticBlock *staticFreeList = nullptr;
+    static const size_t STATIC_ALIGNMENT = alignof(std::max_align_t);
+    static const size_t STATIC_HEADER_SIZE = (sizeof(StaticBlock) + STATIC_ALIGNMENT - 1) / STATIC_ALIGNMENT * STATIC_ALIGNMENT;
+
+    void setStaticBuffer(void *buffer, size_t size)
+    {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(buffer) + STATIC_ALIGNMENT - 1) / STATIC_ALIGNMENT * STATIC_ALIGNMENT;
+        size_t padding = start - reinterpret_cast<uintptr_t>(buffer);
+        staticFreeList = nullptr;
+        if (size < padding + 2 * STATIC_HEADER_SIZE)
+            return;
+
+        staticFreeList = reinterpret_cast<StaticBlock *>(start);
+        staticFreeList->size = (size - padding) / STATIC_ALIGNMENT * STATIC_ALIGNMENT;
+        staticFreeList->next = nullptr;
+    }
+
+    void *allocateStatic(size_t size)
+    {
+        size_t needed = STATIC_HEADER_SIZE + (std::max<size_t>(size, 1) + STATIC_ALIGNMENT - 1) / STATIC_ALIGNMENT * STATIC_ALIGNMENT;
+
+        // First Fit, Splitting Off Any Remainder Large Enough To Be Allocated Again
+        for (StaticBlock **link = &staticFreeList; *link; link = &(*link)->next)
+        {
+            StaticBlock *block = *link;
+            if (block->size < needed)
+                continue;
+
+            if (block->size - needed >= 2 * STATIC_HEADER_SIZE)
+            {
+                StaticBlock *rest = reinterpret_cast<StaticBlock *>(reinterpret_cast<uint8_t *>(block) + needed);
+                rest->size = block->size - needed;
+                rest->next = block->next;
+                block->size = needed;
+                *link = rest;
+            }
+            else
+            {
+                *link = block->next;
+            }
+
+            return reinterpret_cast<uint8_t *>(block) + STATIC_HEADER_SIZE;
+        }
+
+        // Without Exceptions There Is No Way To Report Exhaustion To The Containers
+        std::abort();
+    }
+
+    size_t largestStaticBlock()
+    {
+        size_t largest = 0;
+        for (StaticBlock *block = staticFreeList; block; block = block->next)
+            largest = std::max(largest, block->size);
+
+        return largest;
+    }
+
+    void deallocateStatic(void *pointer)
+    {
+        if (!pointer)
+            return;
+
+        StaticBlock *block = reinterpret_cast<StaticBlock *>(static_cast<uint8_t *>(pointer) - STATIC_HEADER_SIZE);
+        StaticBlock *previous = nullptr;
+        StaticBlock *next = staticFreeList;
+        while (next && reinterpret_cast<uintptr_t>(next) < reinterpret_cast<uintptr_t>(block))
+        {
+            previous = next;
+            next = next->next;
+        }
+
+        // Merge With The Following Block, Then With The Preceding One
+        block->next = next;
+        if (next && reinterpret_cast<uint8_t *>(block) + block->size == reinterpret_cast<uint8_t *>(next))
+        {
+            block->size += next->size;
+            block->next = next->next;
+        }
+
+        if (previous && reinterpret_cast<uint8_t *>(previous) + previous->size == reinterpret_cast<uint8_t *>(block))
+        {
+            previous->size += block->size;
+            previous->next = block->next;
+        }
+        else if (previous)
+        {
+            previous->next = block;
+        }
+        else
+        {
+            staticFreeList = block;
+        }
+    }
+
+    // --------------------------------------------------------------------------------------------------------------------- //
+#endif
+
     // ----------------------------------------    F L A S H    K V    C L A S S    ---------------------------------------- //
 
     FlashKV::FlashKV(FlashWriteFunction flashWriteFunction,
@@ -40,188 +246,3011 @@ namespace FlashKV
                      size_t flashSectorSize,
                      size_t flashAddress,
                      size_t flashSize)
-        : flashWriteFunction(flashWriteFunction),
-          flashReadFunction(flashReadFunc),
-          flashEraseFunction(flashEraseFunction),
+        : FlashKV(callbackDriver, flashPageSize, flashSectorSize, flashAddress, flashSize)
+    {
+        callbackDriver.flashWriteFunction = flashWriteFunction;
+        callbackDriver.flashReadFunction = flashReadFunc;
+        callbackDriver.flashEraseFunction = flashEraseFunction;
+    }
+
+    FlashKV::FlashKV(FlashDriver &flashDriver,
+                     size_t flashPageSize,
+                     size_t flashSectorSize,
+                     size_t flashAddress,
+                     size_t flashSize)
+        : driver(&flashDriver),
+          driverCapabilities(flashDriver.capabilities()),
           flashPageSize(flashPageSize),
+          programSize(driverCapabilities.programSize ? driverCapabilities.programSize : flashPageSize),
           flashSectorSize(flashSectorSize),
           flashAddress(flashAddress),
           flashSize(flashSize)
     {
+        sectors.resize(flashSize / flashSectorSize);
     }
 
     FlashKV::~FlashKV() {}
 
-    // int FlashKV::loadMap()
-    // {
-    //     if (verifySignature())
-    //     {
-    //         serialisedSize = FLASHKV_SIGNATURE_SIZE;
-    //         while (serialisedSize < flashSize)
-    //         {
-    //             auto deserializedPair = deserialiseKeyValuePair(serialisedSize);
+    uint8_t FlashKV::loadMap()
+    {
+        WriteGuard guard(writing);
+        if (!guard)
+            return 0;
 
-    //             if (!deserializedPair.has_value())
-    //                 return 0;
+        // After A Warm Reset The Map Is Mounted From Retained Memory Without Reading Flash Memory
+        if (auto result = restoreSnapshot())
+            return *result;
 
-    //             if (deserializedPair->first == 0)
-    //                 return 1;
+        uint8_t result = load(nullptr);
+        if (result != 0)
+            retainSnapshot();
+
+        return result;
+    }
 
-    //             keyValueMap[deserializedPair->second.first] = deserializedPair->second.second;
-    //             serialisedSize += deserializedPair->first;
-    //         }
-    //     }
+    uint8_t FlashKV::recoverMap(RecoveryReport &report)
+    {
+        WriteGuard guard(writing);
+        if (!guard)
+            return 0;
 
-    //     return false;
-    // }
+        report = RecoveryReport{};
+        return load(&report);
+    }
 
-    uint8_t FlashKV::loadMap()
+    bool FlashKV::saveMap()
     {
-        if (verifySignature())
+        WriteGuard guard(writing);
+        if (!guard || suspendDepth > 0)
+            return false;
+
+        // A Deferred Commit Leaves Changes Only In Memory, So It Is Not Reported As Saved
+        finishErase();
+        if (!admitCommit())
+            return false;
+
+        // Commit Batch By Batch, Compacting In Between Whenever The Region Fills Up
+        size_t stalled = 0;
+        while (true)
         {
-            while (serialisedSize < flashSize)
-            {
-                auto deserializedPair = deserialiseKeyValuePair(serialisedSize);
+            size_t pending = dirtyEntries.size();
+            if (!dirtyEntries.empty() && !hasWork(IoClass::Commit))
+                buildCommit();
 
-                if (!deserializedPair)
-                    return 0;
+            if (!runQueue(IoClass::Commit))
+                return false;
 
-                if (deserializedPair->first == 0)
-                    return 1;
+            retireJournal();
+            retireDamaged();
 
-                keyValueMap[deserializedPair->second.first] = deserializedPair->second.second;
-                serialisedSize += deserializedPair->first;
-            }
+            // Compacted Sectors Are Left For maintenance() To Erase Unless This Commit Needs The Space
+            if (dirtyEntries.empty() && erasedPool > 0)
+                break;
+
+            if (!runQueue(IoClass::Compaction))
+                return false;
+
+            if (dirtyEntries.empty())
+                break;
+
+            // Give Up Once Compaction Stops Making Room
+            stalled = dirtyEntries.size() < pending ? 0 : stalled + 1;
+            if (stalled > sectors.size())
+                return false;
         }
-        return 2;
+
+        retainSnapshot();
+        return true;
     }
 
-    bool FlashKV::saveMap()
+    bool FlashKV::setEmergencyJournal(size_t sectorCount)
     {
-        if (flashEraseFunction(flashAddress, flashSize))
+        size_t totalSectors = flashSize / flashSectorSize;
+        if (sectorCount >= totalSectors)
+            return false;
+
+        sectors.resize(totalSectors - sectorCount);
+        journalSectors = sectorCount;
+        journalOffset = sectors.size() * flashSectorSize;
+        journalBuffer.resize(sectorCount > 0 ? programSize : 0);
+        return true;
+    }
+
+    bool FlashKV::emergencyFlush()
+    {
+        WriteGuard guard(writing);
+        if (!guard || journalSectors == 0 || eraseInProgress || journalErasing)
+            return false;
+
+        // Changes Serialised For A Commit That Has Not Finished Programming Are Written Again
+        const IoQueue &queue = ioQueues[static_cast<size_t>(IoClass::Commit)];
+        bool unfinished = hasWork(IoClass::Commit);
+        auto pending = [&](const KeyEntry &entry)
         {
-            std::vector<uint8_t> buffer;
-            buffer.reserve(serialisedSize);
-            buffer.insert(buffer.end(), std::begin(FLASHKV_SIGNATURE), std::end(FLASHKV_SIGNATURE));
+            if (entry.dirty)
+                return true;
 
-            for (const auto &[key, value] : keyValueMap)
+            for (size_t i = queue.nextOperation; unfinished && entry.location != FLASHKV_NO_LOCATION && i < queue.operations.size(); i++)
             {
-                auto kvBytes = serialiseKeyValuePair(key, value);
-                buffer.insert(buffer.end(), kvBytes.begin(), kvBytes.end());
+                const FlashOperation &operation = queue.operations[i];
+                if (operation.type == FlashOperation::Type::Program && entry.location < operation.offset + operation.size &&
+                    entry.location + entry.storedSize > operation.offset)
+                    return true;
             }
 
-            while (buffer.size() % flashPageSize != 0)
-                buffer.push_back(0);
+            return false;
+        };
+
+        // With Nothing Pending The Journal Is Left Untouched For A Later Failure
+        bool empty = true;
+        if (unfinished)
+        {
+            for (const auto &entry : keyValueMap)
+                empty = empty && !pending(entry.second);
+        }
+        else
+        {
+            for (const auto *entry : dirtyEntries)
+                empty = empty && !pending(entry->second);
+        }
+
+        if (empty)
+            return true;
+
+        invalidateSnapshot();
+
+        // The Batch Replays After Every Sector Opened So Far, Including One Whose Header Is Still Queued
+        size_t end = (sectors.size() + journalSectors) * flashSectorSize;
+        size_t offset = journalOffset;
+        uint32_t sequence = nextSequence - 1;
+        uint8_t header[FLASHKV_SECTOR_HEADER_SIZE] = {};
+        std::memcpy(header, FLASHKV_JOURNAL_SIGNATURE, sizeof(FLASHKV_JOURNAL_SIGNATURE));
+        std::memcpy(header + 4, &sequence, sizeof(uint32_t));
+        uint32_t crc = crc32(0, header, 16);
+        std::memcpy(header + 16, &crc, sizeof(uint32_t));
+
+        if (offset + sizeof(header) > end || !enterExclusive())
+            return false;
+
+        if (!writeJournal(offset, header, sizeof(header)))
+        {
+            leaveExclusive();
+            return false;
+        }
+
+        journalUsed = true;
+        journalSequence = sequence;
+
+        bool complete = true;
+        auto flush = [&](KeyValueMap::value_type &entry)
+        {
+            if (!complete || !pending(entry.second))
+                return;
+
+            uint8_t recordHeader[FLASHKV_RECORD_HEADER_SIZE];
+            fillRecordHeader(recordHeader, entry.first, entry.second);
+            complete = offset + recordSize(entry.first.size(), entry.second.size()) <= end &&
+                       writeJournal(offset, recordHeader, sizeof(recordHeader)) &&
+                       writeJournal(offset, reinterpret_cast<const uint8_t *>(entry.first.data()), entry.first.size()) &&
+                       writeJournal(offset, entry.second.data(), entry.second.size());
+        };
+
+        if (unfinished)
+        {
+            for (auto &entry : keyValueMap)
+                flush(entry);
+        }
+        else
+        {
+            for (auto *entry : dirtyEntries)
+                flush(*entry);
+        }
 
-            return flashWriteFunction(flashAddress, buffer.data(), buffer.size());
+        // Pad The Last Unit With Erased Bytes
+        size_t fill = offset % programSize;
+        if (fill != 0)
+        {
+            std::memset(journalBuffer.data() + fill, FLASHKV_ERASED_VALUE, programSize - fill);
+            invertErased(journalBuffer.data(), programSize);
+            complete = driver->program(flashAddress + offset - fill, journalBuffer.data(), programSize) && complete;
+            offset += programSize - fill;
         }
 
-        return false;
+        leaveExclusive();
+
+        journalOffset = offset;
+        return complete;
     }
 
-    bool FlashKV::writeKey(std::string key, std::vector<uint8_t> value)
+    void FlashKV::setRetainedMemory(void *buffer, size_t size)
     {
-        if (serialisedSize + sizeof(uint16_t) + key.size() + sizeof(uint16_t) + value.size() <= flashSize)
-        {
-            keyValueMap[key] = value;
-            serialisedSize += sizeof(uint16_t) + key.size() + sizeof(uint16_t) + value.size();
+        retainedMemory = static_cast<uint8_t *>(buffer);
+        retainedSize = buffer ? size : 0;
+        retainedCurrent = false;
+        retainedUnfit = false;
+    }
+
+    bool FlashKV::writeKey(const String &key, const Bytes &value)
+    {
+        return writeKey(key, value.data(), value.size());
+    }
+
+    bool FlashKV::writeKey(const String &key, const uint8_t *data, size_t size)
+    {
+        WriteGuard guard(writing);
+        if (!guard || reservedKey(key))
+            return false;
+
+        return storeValue(key, keyValueMap.find(key), data, size);
+    }
+
+    bool FlashKV::storeValue(const String &key, KeyValueMap::iterator it, const uint8_t *data, size_t size)
+    {
+        if (key.empty() || key.size() > UINT16_MAX || size > UINT16_MAX)
+            return false;
+
+        // Only Reserved Capacity Can Be Used, Since Growing A Value Would Allocate
+        if (boundedLatency && (it == keyValueMap.end() || size > maxValueSize || size > it->second.value.capacity()))
+            return false;
+
+        // Every Record Has To Fit In A Sector, And Every Key Has To Fit In The Region
+        size_t newSize = recordSize(key.size(), size);
+        size_t previousSize = it != keyValueMap.end() ? recordSize(key.size(), it->second.size()) : 0;
+        if (newSize > flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE || serialisedSize - previousSize + newSize > capacity())
+            return false;
+
+        if (!memoryAvailable(it != keyValueMap.end() ? &it->second : nullptr, key.size(), size, false))
+            return false;
+
+        // Rewriting The Same Value Leaves Nothing To Commit
+        if (it != keyValueMap.end() && !it->second.erased && it->second.size() == size &&
+            std::equal(data, data + size, it->second.data()))
+            return true;
+
+        if (it == keyValueMap.end())
+            it = keyValueMap.try_emplace(key).first;
+
+        // Assign In Place So Reserved Capacity Is Reused
+        beginChange(it->second);
+        it->second.value.assign(data, data + size);
+        it->second.head = 0;
+        it->second.erased = false;
+        endChange(it->second);
+        it->second.appendedSize = 0;
+        serialisedSize = serialisedSize - previousSize + newSize;
+        markDirty(*it);
+        return true;
+    }
+
+    bool FlashKV::appendToKey(const String &key, const Bytes &data, size_t maxSize)
+    {
+        return appendToKey(key, data.data(), data.size(), maxSize);
+    }
+
+    bool FlashKV::appendToKey(const String &key, const uint8_t *data, size_t size, size_t maxSize)
+    {
+        WriteGuard guard(writing);
+        if (!guard || reservedKey(key) || size > UINT16_MAX || maxSize > UINT16_MAX)
+            return false;
+
+        if (size == 0)
             return true;
+
+        // A New Key Simply Holds The Latest Data
+        auto it = keyValueMap.find(key);
+        if (it == keyValueMap.end() || it->second.erased)
+        {
+            size_t kept = maxSize ? std::min(size, maxSize) : size;
+            return storeValue(key, it, data + size - kept, kept);
+        }
+
+        KeyEntry &entry = it->second;
+        size_t total = entry.size() + size;
+        size_t trimmed = maxSize && total > maxSize ? total - maxSize : 0;
+        size_t valueSize = total - trimmed;
+        if (valueSize > UINT16_MAX || (boundedLatency && (valueSize > maxValueSize || valueSize > entry.value.capacity())))
+            return false;
+
+        size_t newSize = recordSize(key.size(), valueSize);
+        size_t previousSize = recordSize(key.size(), entry.size());
+        if (newSize > flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE || serialisedSize - previousSize + newSize > capacity() ||
+            !memoryAvailable(&entry, key.size(), entry.value.size() + size, true))
+            return false;
+
+        beginChange(entry);
+        appendValue(entry, data, size, maxSize);
+        endChange(entry);
+        serialisedSize = serialisedSize - previousSize + newSize;
+
+        // Appends Are Combined Into One Record While They Share A Limit And Are Still Part Of The Value
+        bool appending = entry.appendedSize > 0 || !entry.dirty;
+        if (appending && entry.location != FLASHKV_NO_LOCATION && (entry.appendedSize == 0 || entry.appendLimit == maxSize) &&
+            entry.appendedSize + size <= valueSize)
+        {
+            entry.appendedSize += size;
+            entry.appendLimit = maxSize;
         }
+        else
+            entry.appendedSize = 0;
 
-        return false;
+        markDirty(*it);
+        return true;
     }
 
-    std::optional<std::vector<uint8_t>> FlashKV::readKey(std::string key)
+    std::optional<Bytes> FlashKV::readKey(const String &key)
     {
         auto it = keyValueMap.find(key);
-        if (it != keyValueMap.end())
-            return it->second;
+        if (it != keyValueMap.end() && !it->second.erased)
+            return Bytes(it->second.data(), it->second.data() + it->second.size());
 
         return std::nullopt;
     }
 
-    bool FlashKV::eraseKey(std::string key)
+    std::optional<size_t> FlashKV::readKeyInto(const String &key, uint8_t *buffer, size_t bufferSize)
+    {
+        uint32_t version;
+        return readKeyInto(key, buffer, bufferSize, version);
+    }
+
+    std::optional<size_t> FlashKV::readKeyInto(const String &key, uint8_t *buffer, size_t bufferSize, uint32_t &version)
     {
         auto it = keyValueMap.find(key);
-        if (it != keyValueMap.end())
+        if (it == keyValueMap.end())
+            return std::nullopt;
+
+        // Copy Optimistically And Keep The Copy Only If No Change Overlapped It
+        const KeyEntry &entry = it->second;
+        for (uint8_t attempt = 0; attempt < FLASHKV_READ_ATTEMPTS; attempt++)
         {
-            serialisedSize -= sizeof(uint16_t) + key.size() + sizeof(uint16_t) + it->second.size();
-            keyValueMap.erase(it);
-            return true;
+            version = entry.version.load(std::memory_order_acquire);
+            if (version & 1)
+                continue;
+
+            size_t size = entry.size();
+            bool found = !entry.erased && size <= bufferSize;
+            if (found)
+                std::memcpy(buffer, entry.data(), size);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (entry.version.load(std::memory_order_relaxed) == version)
+                return found ? std::optional<size_t>(size) : std::nullopt;
         }
 
-        return false;
+        return std::nullopt;
     }
 
-    std::vector<std::string> FlashKV::getAllKeys()
+    bool FlashKV::compareExchange(const String &key, const Bytes &expected, const Bytes &desired)
     {
-        std::vector<std::string> keys;
-        for (const auto &[key, value] : keyValueMap)
-            keys.push_back(key);
-        return keys;
+        // The Map Is Held From The Comparison To The Write, So No Other Write Can Come Between Them
+        WriteGuard guard(writing);
+        if (!guard)
+            return false;
+
+        auto it = keyValueMap.find(key);
+        if (reservedKey(key) || it == keyValueMap.end() || it->second.erased || it->second.size() != expected.size() ||
+            !std::equal(expected.begin(), expected.end(), it->second.data()))
+            return false;
+
+        return storeValue(key, it, desired.data(), desired.size());
     }
 
-    // --------------------------------------------------------------------------------------------------------------------- //
+    bool FlashKV::compareExchange(const String &key, uint32_t expectedVersion, const Bytes &desired)
+    {
+        WriteGuard guard(writing);
+        if (!guard)
+            return false;
 
-    // --------------------------------------    H E L P E R    F U N C T I O N S    --------------------------------------- //
+        auto it = keyValueMap.find(key);
+        if (reservedKey(key) || it == keyValueMap.end() || it->second.erased ||
+            it->second.version.load(std::memory_order_relaxed) != expectedVersion)
+            return false;
 
-    bool FlashKV::verifySignature()
+        return storeValue(key, it, desired.data(), desired.size());
+    }
+
+    bool FlashKV::eraseKey(const String &key)
     {
-        uint8_t signature[FLASHKV_SIGNATURE_SIZE];
-        if (!flashReadFunction(flashAddress, signature, FLASHKV_SIGNATURE_SIZE))
+        WriteGuard guard(writing);
+        if (!guard || reservedKey(key))
             return false;
 
-        return std::memcmp(signature, FLASHKV_SIGNATURE, FLASHKV_SIGNATURE_SIZE) == 0;
+        auto it = keyValueMap.find(key);
+        if (it == keyValueMap.end() || it->second.erased)
+            return false;
+
+        return eraseEntry(*it);
     }
 
-    std::vector<uint8_t> FlashKV::serialiseKeyValuePair(const std::string &key, const std::vector<uint8_t> &value)
+    bool FlashKV::eraseEntry(KeyValueMap::value_type &entry)
     {
-        std::vector<uint8_t> buffer;
-        uint16_t keySize = key.size();
-        uint16_t valueSize = value.size();
+        if (!memoryAvailable(&entry.second, entry.first.size(), 0, false))
+            return false;
+
+        // The Key Is Kept Until A Deletion Record Has Been Committed
+        serialisedSize -= entry.second.size();
+        beginChange(entry.second);
+        entry.second.value.clear();
+        entry.second.head = 0;
+        entry.second.erased = true;
+        endChange(entry.second);
+        entry.second.appendedSize = 0;
+        markDirty(entry);
+        return true;
+    }
 
-        buffer.insert(buffer.end(), reinterpret_cast<uint8_t *>(&keySize), reinterpret_cast<uint8_t *>(&keySize) + sizeof(uint16_t));
-        buffer.insert(buffer.end(), key.begin(), key.end());
+    void FlashKV::appendValue(KeyEntry &entry, const uint8_t *data, size_t size, size_t limit)
+    {
+        size_t total = entry.size() + size;
+        size_t trimmed = limit && total > limit ? total - limit : 0;
+        if (trimmed >= entry.size())
+        {
+            entry.value.assign(data + trimmed - entry.size(), data + size);
+            entry.head = 0;
+            return;
+        }
 
-        buffer.insert(buffer.end(), reinterpret_cast<uint8_t *>(&valueSize), reinterpret_cast<uint8_t *>(&valueSize) + sizeof(uint16_t));
-        buffer.insert(buffer.end(), value.begin(), value.end());
+        // Trimming Only Moves The Head, And The Bytes Behind It Are Released Once They Outnumber Those In Front, So Each
+        // Byte Is Moved At Most Once On Average. Bounded Latency Mode Cannot Grow The Value, So It Releases Them Sooner.
+        entry.head += trimmed;
+        if (entry.head >= entry.size() || (boundedLatency && entry.value.size() + size > entry.value.capacity()))
+        {
+            entry.value.erase(entry.value.begin(), entry.value.begin() + entry.head);
+            entry.head = 0;
+        }
 
-        return buffer;
+        entry.value.insert(entry.value.end(), data, data + size);
     }
 
-    std::optional<std::pair<size_t, KeyValue>> FlashKV::deserialiseKeyValuePair(size_t offset)
+    bool FlashKV::memoryAvailable(const KeyEntry *entry, size_t keySize, size_t valueSize, bool appending) const
     {
-        size_t initialOffset = offset;
-        uint16_t keySize;
-        if (!flashReadFunction(flashAddress + offset, reinterpret_cast<uint8_t *>(&keySize), sizeof(uint16_t)))
-            return std::nullopt;
+#ifdef FLASHKV_EMBEDDED
+        // Running Out Part Way Through A Change Would Abort, So Everything It Can Allocate Must Fit In One Free Block
+        auto allocation = [](size_t size)
+        { return STATIC_HEADER_SIZE + (size + STATIC_ALIGNMENT - 1) / STATIC_ALIGNMENT * STATIC_ALIGNMENT; };
 
-        if (keySize == 0)
-            return std::make_pair(0, KeyValue());
+        size_t needed = 0;
+        if (!entry)
+        {
+            // A New Key Adds A Node, A Copy Of The Key And Possibly A Larger Bucket Array
+            needed += allocation(sizeof(KeyValueMap::value_type) + 4 * sizeof(void *)) + allocation(keySize + 1);
+#ifndef FLASHKV_ORDERED_INDEX
+            needed += allocation((2 * keyValueMap.bucket_count() + 64) * sizeof(void *));
+#endif
+        }
 
-        offset += sizeof(uint16_t);
+        // Values Are Reallocated To Their New Size When Written, And Up To Twice It When Appended To
+        if (!entry || valueSize > entry->value.capacity())
+            needed += allocation(appending ? 2 * valueSize : valueSize);
 
-        std::string key;
-        key.resize(keySize);
-        if (!flashReadFunction(flashAddress + offset, reinterpret_cast<uint8_t *>(&key[0]), keySize))
+        if ((!entry || !entry->queued) && dirtyEntries.size() == dirtyEntries.capacity())
+            needed += allocation((2 * dirtyEntries.capacity() + 1) * sizeof(void *));
+
+        return needed <= largestStaticBlock();
+#else
+        (void)entry;
+        (void)keySize;
+        (void)valueSize;
+        (void)appending;
+        return true;
+#endif
+    }
+
+    bool FlashKV::reservedKey(const String &key) const
+    {
+        return !key.empty() && key[0] == '\0';
+    }
+
+    Vector<String> FlashKV::getAllKeys()
+    {
+        Vector<String> keys;
+        for (const auto &[key, entry] : keyValueMap)
+            if (!entry.erased && key[0] != '\0')
+                keys.push_back(key);
+        return keys;
+    }
+
+    bool FlashKV::pushToQueue(const String &queue, const Bytes &data)
+    {
+        return pushToQueue(queue, data.data(), data.size());
+    }
+
+    bool FlashKV::pushToQueue(const String &queue, const uint8_t *data, size_t size)
+    {
+        WriteGuard guard(writing);
+        if (!guard)
+            return false;
+
+        auto pointers = readQueue(queue);
+        if (!pointers)
+            return false;
+
+        // The Entry Is Removed Again If The Queue Cannot Be Updated, So It Is Never Left Past The Tail
+        auto [head, tail] = *pointers;
+        String key = queueEntryKey(queue, tail);
+        auto it = keyValueMap.find(key);
+        if (!storeValue(key, it, data, size))
+            return false;
+
+        if (!writeQueue(queue, head, tail + 1))
+        {
+            eraseEntry(*keyValueMap.find(key));
+            return false;
+        }
+
+        return true;
+    }
+
+    std::optional<Bytes> FlashKV::popFromQueue(const String &queue)
+    {
+        WriteGuard guard(writing);
+        if (!guard)
             return std::nullopt;
 
-        offset += keySize;
+        auto pointers = readQueue(queue);
+        if (!pointers)
+            return std::nullopt;
 
-        uint16_t valueSize;
-        if (!flashReadFunction(flashAddress + offset, reinterpret_cast<uint8_t *>(&valueSize), sizeof(uint16_t)))
+        auto [head, tail] = *pointers;
+        auto it = findQueueFront(queue, head, tail);
+        if (it == keyValueMap.end())
+        {
+            // Skipped Entries Are Dropped From The Queue So They Are Not Searched Again
+            if (head != pointers->first)
+                writeQueue(queue, head, tail);
+
+            return std::nullopt;
+        }
+
+        // The Entry Is Written Back If The Head Cannot Be Moved, So A Failed Pop Leaves The Queue As It Was
+        Bytes value(it->second.data(), it->second.data() + it->second.size());
+        if (!eraseEntry(*it))
             return std::nullopt;
 
-        offset += sizeof(uint16_t);
+        // Moving The Head Is What Removes The Entry, So It Commits No Deletion Record And Its Old Record Is Dead Space
+        setLocation(it->second, FLASHKV_NO_LOCATION, 0);
+
+        if (!writeQueue(queue, head + 1, tail))
+        {
+            storeValue(it->first, it, value.data(), value.size());
+            return std::nullopt;
+        }
+
+        return value;
+    }
+
+    std::optional<Bytes> FlashKV::peekQueue(const String &queue)
+    {
+        auto pointers = readQueue(queue);
+        if (!pointers)
+            return std::nullopt;
+
+        auto [head, tail] = *pointers;
+        auto it = findQueueFront(queue, head, tail);
+        if (it == keyValueMap.end())
+            return std::nullopt;
+
+        return Bytes(it->second.data(), it->second.data() + it->second.size());
+    }
+
+    size_t FlashKV::getQueueLength(const String &queue)
+    {
+        auto pointers = readQueue(queue);
+        if (!pointers)
+            return 0;
+
+        // Entries Skipped After A Power Loss Or Dropped By recoverMap() Are Not Counted
+        size_t length = 0;
+        for (uint32_t index = pointers->first; index != pointers->second; index++)
+        {
+            auto it = keyValueMap.find(queueEntryKey(queue, index));
+            if (it != keyValueMap.end() && !it->second.erased)
+                length++;
+        }
+
+        return length;
+    }
+
+    std::optional<std::pair<uint32_t, uint32_t>> FlashKV::readQueue(const String &queue) const
+    {
+        if (queue.empty() || queue.find('\0') != String::npos)
+            return std::nullopt;
+
+        // The Head And Tail Share One Record Under The Queue's Name, Behind A Prefix Ordinary Keys Do Not Use
+        String key(1, '\0');
+        key += queue;
+        auto it = keyValueMap.find(key);
+        if (it == keyValueMap.end() || it->second.erased || it->second.size() != 2 * sizeof(uint32_t))
+            return std::make_pair(0u, 0u);
+
+        uint32_t head, tail;
+        std::memcpy(&head, it->second.data(), sizeof(uint32_t));
+        std::memcpy(&tail, it->second.data() + sizeof(uint32_t), sizeof(uint32_t));
+        return std::make_pair(head, tail);
+    }
+
+    bool FlashKV::writeQueue(const String &queue, uint32_t head, uint32_t tail)
+    {
+        String key(1, '\0');
+        key += queue;
+
+        uint8_t value[2 * sizeof(uint32_t)];
+        std::memcpy(value, &head, sizeof(uint32_t));
+        std::memcpy(value + sizeof(uint32_t), &tail, sizeof(uint32_t));
+        return storeValue(key, keyValueMap.find(key), value, sizeof(value));
+    }
+
+    String FlashKV::queueEntryKey(const String &queue, uint32_t index) const
+    {
+        // Entries Follow The Queue's Name And A Separator, So They Never Collide With Its Head And Tail
+        String key(1, '\0');
+        key += queue;
+        key += '\0';
+        key.append(reinterpret_cast<const char *>(&index), sizeof(uint32_t));
+        return key;
+    }
+
+    void FlashKV::dropPoppedEntries()
+    {
+        // Entries Behind The Head Were Popped, And Entries At Or Past The Tail Were Pushed By A Commit Cut Short
+        for (auto it = keyValueMap.begin(); it != keyValueMap.end();)
+        {
+            const String &key = it->first;
+            size_t separator = reservedKey(key) ? key.find('\0', 1) : String::npos;
+            auto pointers = separator != String::npos && key.size() == separator + 1 + sizeof(uint32_t)
+                                ? readQueue(key.substr(1, separator - 1))
+                                : std::nullopt;
+
+            uint32_t index = 0;
+            if (pointers)
+                std::memcpy(&index, key.data() + separator + 1, sizeof(uint32_t));
+
+            // Keys Replayed From The Journal Are Left For The Next Load, Since The Commit Still Refers To Them
+            KeyEntry &entry = it->second;
+            if (!pointers || index - pointers->first < pointers->second - pointers->first || entry.queued)
+            {
+                ++it;
+                continue;
+            }
+
+            serialisedSize -= recordSize(key.size(), entry.size());
+            setLocation(entry, FLASHKV_NO_LOCATION, 0);
+            it = keyValueMap.erase(it);
+        }
+    }
+
+    KeyValueMap::iterator FlashKV::findQueueFront(const String &queue, uint32_t &head, uint32_t tail)
+    {
+        // Entries Whose Deletion Reached Flash Memory Before The Head Moved Past Them Are Skipped
+        for (; head != tail; head++)
+        {
+            auto it = keyValueMap.find(queueEntryKey(queue, head));
+            if (it != keyValueMap.end() && !it->second.erased)
+                return it;
+        }
+
+        return keyValueMap.end();
+    }
+
+    void FlashKV::reserve(size_t keyCount)
+    {
+        // An Ordered Index Allocates Per Key, So There Is Nothing To Reserve
+#ifndef FLASHKV_ORDERED_INDEX
+        // Growing Only, So A Reservation Made Before loadMap() Survives The Load
+        if (keyCount > keyValueMap.bucket_count() * keyValueMap.max_load_factor())
+            keyValueMap.reserve(keyCount);
+#else
+        (void)keyCount;
+#endif
+    }
+
+    MemoryUsage FlashKV::memoryUsage() const
+    {
+        MemoryUsage usage{};
+
+#ifdef FLASHKV_ORDERED_INDEX
+        // One Node Per Entry (Parent, Left And Right Pointers, Colour And The Pair Itself)
+        usage.indexBytes = keyValueMap.size() * (3 * sizeof(void *) + sizeof(size_t) + sizeof(KeyValueMap::value_type));
+#else
+        // Buckets Plus One Node Per Entry (Next Pointer, Cached Hash And The Pair Itself)
+        usage.indexBytes = keyValueMap.bucket_count() * sizeof(void *) +
+                           keyValueMap.size() * (sizeof(void *) + sizeof(size_t) + sizeof(KeyValueMap::value_type));
+#endif
+
+        const size_t inlineKeyCapacity = String().capacity();
+        for (const auto &[key, entry] : keyValueMap)
+        {
+            if (key.capacity() > inlineKeyCapacity)
+                usage.keyBytes += key.capacity() + 1;
+            usage.valueBytes += entry.value.capacity();
+        }
+
+        usage.totalBytes = usage.indexBytes + usage.keyBytes + usage.valueBytes;
+        return usage;
+    }
+
+    void FlashKV::setClockFunction(ClockFunction clockFunction)
+    {
+        this->clockFunction = clockFunction;
+    }
+
+    bool FlashKV::enableBoundedLatency(size_t maxKeys, size_t maxValueSize)
+    {
+        if (keyValueMap.size() > maxKeys)
+            return false;
+
+        for (const auto &[key, entry] : keyValueMap)
+            if (entry.size() > maxValueSize)
+                return false;
+
+        // Pre-Size Everything So Writes Never Allocate Or Rehash
+        this->maxKeys = maxKeys;
+        this->maxValueSize = maxValueSize;
+        reserveBounded();
+        programBuffer.reserve(std::max(flashPageSize, driverCapabilities.maxTransferSize));
+
+        boundedLatency = true;
+        return true;
+    }
+
+    void FlashKV::reserveBounded()
+    {
+        reserve(maxKeys);
+        for (auto &[key, entry] : keyValueMap)
+            entry.value.reserve(maxValueSize);
+
+        dirtyEntries.reserve(maxKeys);
+
+        // A Commit Holds Up To A Full Sector Of Changes Plus Every Key Moved By Compaction, With A Header And Padding Per Sector
+        size_t regionSectors = sectors.size() + journalSectors;
+        size_t commitSize = flashSectorSize + regionSectors * (FLASHKV_SECTOR_HEADER_SIZE + programSize);
+        for (const auto &[key, entry] : keyValueMap)
+            commitSize += recordSize(key.size(), FLASHKV_APPEND_HEADER_SIZE + maxValueSize);
+
+        // Each Sector Opened Adds An Erase And A Segment, Whose Programs May Start And End Part Way Through A Page
+        size_t transferSize = driverCapabilities.maxTransferSize ? std::max<size_t>(driverCapabilities.maxTransferSize / programSize, 1) * programSize : flashPageSize;
+        commitBuffer.reserve(commitSize);
+        ioQueues[static_cast<size_t>(IoClass::Commit)].operations.reserve(commitSize / transferSize + 3 * regionSectors);
+        ioQueues[static_cast<size_t>(IoClass::Compaction)].operations.reserve(regionSectors);
+    }
+
+    void FlashKV::disableBoundedLatency()
+    {
+        boundedLatency = false;
+
+        // Drop The Erased Keys Kept While Interrupts Could Be Reading The Index
+        for (auto it = keyValueMap.begin(); it != keyValueMap.end();)
+        {
+            if (it->second.erased && it->second.location == FLASHKV_NO_LOCATION && !it->second.queued)
+            {
+                serialisedSize -= recordSize(it->first.size(), 0);
+                it = keyValueMap.erase(it);
+                continue;
+            }
+
+            ++it;
+        }
+    }
+
+    uint8_t FlashKV::maintenance(uint64_t budgetMicros)
+    {
+        // A Call Made While Another Holds The Map Leaves The Work For Later
+        WriteGuard guard(writing);
+        if (!guard)
+            return 2;
+
+        // Poll For Completion Of An Asynchronous Erase
+        if (eraseInProgress)
+        {
+            if (suspendDepth > 0 || driver->busy())
+                return 2;
+
+            finishErase();
+        }
+
+        if (!dirtyEntries.empty() && !hasWork(IoClass::Commit) && admitCommit())
+            buildCommit();
+
+        if (!hasWork(IoClass::Commit))
+        {
+            retireJournal();
+            retireDamaged();
+            fillErasedPool();
+        }
+
+        // Pick The Highest Priority Work Again After Every Operation
+        uint64_t start = clockFunction ? clockFunction() : 0;
+        size_t steps = 0;
+        while (suspendDepth == 0)
+        {
+            auto ioClass = nextIoClass();
+            if (!ioClass)
+                break;
+
+            // Only Start Work That Is Known To Fit In The Remaining Budget
+            if (clockFunction)
+            {
+                uint64_t worstMicros = worstReadMicros;
+                if (*ioClass != IoClass::Scrub)
+                {
+                    const IoQueue &queue = ioQueues[static_cast<size_t>(*ioClass)];
+                    worstMicros = queue.operations[queue.nextOperation].type == FlashOperation::Type::Erase ? worstEraseMicros : worstProgramMicros;
+                }
+
+                if (clockFunction() - start + worstMicros > budgetMicros)
+                    break;
+            }
+
+            // Consecutive Programs And Erases Share One Exclusive Section, Which Is Left Before Scrub Reads
+            if (*ioClass == IoClass::Scrub)
+                leaveExclusive();
+            else if (!enterExclusive())
+                return 0;
+
+            if (!runStep(*ioClass))
+            {
+                leaveExclusive();
+                return 0;
+            }
+
+            steps++;
+            if (eraseInProgress || !clockFunction)
+                break;
+        }
+
+        leaveExclusive();
+
+        // Copying The Map Into Retained Memory Takes Time In Proportion To Its Size, So It Is Budgeted Like A Flash Step
+        if (snapshotDue() && suspendDepth == 0 && (clockFunction ? clockFunction() - start + worstSnapshotMicros <= budgetMicros : steps == 0))
+        {
+            uint64_t snapshotStart = clockFunction ? clockFunction() : 0;
+            retainSnapshot();
+            if (clockFunction)
+                worstSnapshotMicros = std::max(worstSnapshotMicros, clockFunction() - snapshotStart);
+        }
+
+        for (size_t i = 0; i < static_cast<size_t>(IoClass::Count); i++)
+            if (hasWork(static_cast<IoClass>(i)))
+                return 2;
+
+        return dirtyEntries.empty() && !snapshotDue() ? 1 : 2;
+    }
+
+    void FlashKV::setErasedPool(size_t sectorCount)
+    {
+        erasedPool = sectorCount;
+    }
+
+    void FlashKV::fillErasedPool()
+    {
+        size_t erased = 0;
+        for (const auto &info : sectors)
+            erased += info.state == SectorInfo::State::Free || info.state == SectorInfo::State::Erasing;
+
+        // Unreadable Sectors And Sectors Whose Records Have All Been Superseded Are Erased Ahead Of Time
+        for (size_t i = 0; i < sectors.size() && erased < erasedPool; i++)
+        {
+            SectorInfo &info = sectors[i];
+            bool superseded = info.state == SectorInfo::State::Used && info.liveRecords == 0;
+            if (i == activeSector || (info.state != SectorInfo::State::Garbage && !superseded))
+                continue;
+
+            info.state = SectorInfo::State::Erasing;
+            info.eraseCount++;
+            queueErase(IoClass::Compaction, i);
+            erased++;
+        }
+    }
+
+    void FlashKV::setEraseSuspendFunctions(FlashEraseStartFunction flashEraseStartFunction,
+                                           FlashBusyFunction flashBusyFunction,
+                                           FlashSuspendFunction flashSuspendFunction,
+                                           FlashResumeFunction flashResumeFunction)
+    {
+        callbackDriver.flashEraseStartFunction = flashEraseStartFunction;
+        callbackDriver.flashBusyFunction = flashBusyFunction;
+        callbackDriver.flashSuspendFunction = flashSuspendFunction;
+        callbackDriver.flashResumeFunction = flashResumeFunction;
+        driverCapabilities = driver->capabilities();
+    }
+
+    void FlashKV::setExclusiveFunctions(FlashBeginExclusiveFunction flashBeginExclusiveFunction,
+                                        FlashEndExclusiveFunction flashEndExclusiveFunction)
+    {
+        callbackDriver.flashBeginExclusiveFunction = flashBeginExclusiveFunction;
+        callbackDriver.flashEndExclusiveFunction = flashEndExclusiveFunction;
+    }
+
+    bool FlashKV::suspendMaintenance()
+    {
+        if (eraseInProgress && !eraseSuspended)
+        {
+            if (!driver->suspend())
+                return false;
+
+            eraseSuspended = true;
+        }
+
+        suspendDepth++;
+        return true;
+    }
+
+    bool FlashKV::resumeMaintenance()
+    {
+        if (suspendDepth == 0)
+            return false;
+
+        if (--suspendDepth == 0 && eraseSuspended)
+        {
+            eraseSuspended = false;
+            return driver->resume();
+        }
+
+        return true;
+    }
+
+    bool FlashKV::priorityRead(uint32_t flashAddress, uint8_t *data, size_t count)
+    {
+        if (!suspendMaintenance())
+            return false;
+
+        bool success = driver->read(flashAddress, data, count);
+        return resumeMaintenance() && success;
+    }
+
+    void FlashKV::setRateLimit(IoClass ioClass, size_t bytesPerSecond)
+    {
+        IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+        queue.bytesPerSecond = bytesPerSecond;
+        queue.tokens = std::max(bytesPerSecond, flashSectorSize);
+        queue.lastRefill = clockFunction ? clockFunction() : 0;
+    }
+
+#ifndef FLASHKV_NO_SCRUB
+    void FlashKV::scrubMap()
+    {
+        scrubActive = true;
+        scrubSector = 0;
+        scrubOffset = FLASHKV_SECTOR_HEADER_SIZE;
+        scrubRecords = 0;
+        scrubHeaderChecked = false;
+    }
+#endif
+
+    bool FlashKV::setWearBudget(uint32_t maxErases, size_t maxBytesProgrammed, uint64_t windowMicros)
+    {
+        if ((maxErases > 0 || maxBytesProgrammed > 0) && !clockFunction)
+            return false;
+
+        wearBudgetErases = maxErases;
+        wearBudgetBytes = maxBytesProgrammed;
+        wearWindowMicros = windowMicros;
+        wearWindowStart = clockFunction ? clockFunction() : 0;
+        wearWindowErases = 0;
+        wearWindowBytes = 0;
+        return true;
+    }
+
+    void FlashKV::setWearLevelling(uint32_t maxEraseSkew)
+    {
+        this->maxEraseSkew = maxEraseSkew;
+    }
+
+    Statistics FlashKV::getStatistics() const
+    {
+        return statistics;
+    }
+
+    Vector<SectorUsage> FlashKV::getSectorUsage() const
+    {
+        Vector<SectorUsage> usage;
+        usage.reserve(sectors.size());
+        for (const auto &info : sectors)
+        {
+            SectorUsage sector{};
+            sector.used = info.state == SectorInfo::State::Used;
+            sector.eraseCount = info.eraseCount;
+            if (sector.used)
+            {
+                size_t written = std::max<size_t>(info.writeOffset, FLASHKV_SECTOR_HEADER_SIZE) - FLASHKV_SECTOR_HEADER_SIZE;
+                sector.liveBytes = info.liveBytes;
+                sector.deadBytes = written > info.liveBytes ? written - info.liveBytes : 0;
+            }
+
+            usage.push_back(sector);
+        }
+
+        return usage;
+    }
+
+#ifdef FLASHKV_PARALLEL_LOAD
+    void FlashKV::setLoadThreads(size_t threadCount)
+    {
+        loadThreads = std::max<size_t>(threadCount, 1);
+    }
+#endif
+
+    // --------------------------------------------------------------------------------------------------------------------- //
+
+    // ---------------------------------------    C A L L B A C K    D R I V E R    ---------------------------------------- //
+
+    bool FlashKV::CallbackDriver::read(uint32_t flashAddress, uint8_t *data, size_t count)
+    {
+        return flashReadFunction(flashAddress, data, count);
+    }
+
+    bool FlashKV::CallbackDriver::program(uint32_t flashAddress, const uint8_t *data, size_t count)
+    {
+        return flashWriteFunction(flashAddress, data, count);
+    }
+
+    bool FlashKV::CallbackDriver::erase(uint32_t flashAddress, size_t count)
+    {
+        return flashEraseFunction(flashAddress, count);
+    }
+
+    FlashCapabilities FlashKV::CallbackDriver::capabilities() const
+    {
+        FlashCapabilities capabilities;
+        capabilities.asyncErase = static_cast<bool>(flashEraseStartFunction);
+        return capabilities;
+    }
+
+    bool FlashKV::CallbackDriver::eraseStart(uint32_t flashAddress, size_t count)
+    {
+        return flashEraseStartFunction(flashAddress, count);
+    }
+
+    bool FlashKV::CallbackDriver::busy()
+    {
+        return flashBusyFunction();
+    }
+
+    bool FlashKV::CallbackDriver::suspend()
+    {
+        return flashSuspendFunction();
+    }
+
+    bool FlashKV::CallbackDriver::resume()
+    {
+        return flashResumeFunction();
+    }
+
+    bool FlashKV::CallbackDriver::beginExclusive()
+    {
+        return !flashBeginExclusiveFunction || flashBeginExclusiveFunction();
+    }
+
+    void FlashKV::CallbackDriver::endExclusive()
+    {
+        if (flashEndExclusiveFunction)
+            flashEndExclusiveFunction();
+    }
+
+    // --------------------------------------------------------------------------------------------------------------------- //
+
+    // --------------------------------------    H E L P E R    F U N C T I O N S    --------------------------------------- //
+
+#ifndef FLASHKV_NO_LEGACY_FORMAT
+    bool FlashKV::verifySignature()
+    {
+        uint8_t signature[FLASHKV_SIGNATURE_SIZE];
+        if (!readFlash(0, signature, FLASHKV_SIGNATURE_SIZE))
+            return false;
+
+        return std::memcmp(signature, FLASHKV_SIGNATURE, FLASHKV_SIGNATURE_SIZE) == 0;
+    }
+#endif
+
+    void FlashKV::resetState()
+    {
+        finishErase();
+        keyValueMap.clear();
+        dirtyEntries.clear();
+        commitBuffer.clear();
+        for (auto &queue : ioQueues)
+        {
+            queue.operations.clear();
+            queue.nextOperation = 0;
+        }
+
+        std::fill(sectors.begin(), sectors.end(), SectorInfo());
+        serialisedSize = 0;
+        activeSector = SIZE_MAX;
+        nextSequence = 1;
+        segmentStart = SIZE_MAX;
+        journalOffset = sectors.size() * flashSectorSize;
+        journalUsed = false;
+        journalErasing = false;
+#ifndef FLASHKV_NO_SCRUB
+        scrubActive = false;
+#endif
+    }
+
+    uint8_t FlashKV::load(RecoveryReport *report)
+    {
+        resetState();
+
+        // Fetch Every Sector Header In One Request Where The Driver Supports It
+        Bytes headers;
+        if (driverCapabilities.vectoredRead)
+        {
+            headers.resize(sectors.size() * FLASHKV_SECTOR_HEADER_SIZE);
+            Vector<FlashReadRequest> requests;
+            for (size_t sector = 0; sector < sectors.size(); sector++)
+                requests.push_back({static_cast<uint32_t>(flashAddress + sector * flashSectorSize), headers.data() + sector * FLASHKV_SECTOR_HEADER_SIZE, FLASHKV_SECTOR_HEADER_SIZE});
+
+            if (!driver->readVector(requests.data(), requests.size()))
+                return 0;
+
+            invertErased(headers.data(), headers.size());
+        }
+
+        // Classify Every Sector From Its Header
+        if (!runParallel(sectors.size(), [&](size_t sector)
+                         { return readSectorHeader(sector, headers.empty() ? nullptr : headers.data() + sector * FLASHKV_SECTOR_HEADER_SIZE); }))
+            return 0;
+
+        bool found = false;
+#ifndef FLASHKV_NO_LEGACY_FORMAT
+        // Maps Written By FlashKV 1.0 Are Loaded First And Converted By The Next Commit
+        if (verifySignature())
+        {
+            if (!loadLegacyMap() || serialisedSize > capacity())
+                return 0;
+
+            found = true;
+        }
+#endif
+
+        // When Recovering, Sectors With A Damaged Header Are Searched For Records As If They Were The Oldest
+        for (auto &sector : sectors)
+        {
+            if (!report || sector.state != SectorInfo::State::Garbage)
+                continue;
+
+            sector.state = SectorInfo::State::Used;
+            sector.sequence = 0;
+            sector.damaged = true;
+        }
+
+        // Replay Sectors From Oldest To Newest So That Later Records Win
+        Vector<size_t> order;
+        uint32_t maxEraseCount = 0;
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            if (sectors[sector].state != SectorInfo::State::Used)
+                continue;
+
+            order.push_back(sector);
+            maxEraseCount = std::max(maxEraseCount, sectors[sector].eraseCount);
+        }
+
+        // Ties Between Recovered Sectors Keep Their Physical Order Without The Buffer std::stable_sort() Allocates
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b)
+                  { return std::make_pair(sectors[a].sequence, a) < std::make_pair(sectors[b].sequence, b); });
+
+        if (!loadSectors(order, report))
+            return 0;
+
+        for (size_t sector : order)
+        {
+            activeSector = sector;
+            nextSequence = sectors[sector].sequence + 1;
+            found = true;
+        }
+
+        // Sectors Without A Header Are Assumed To Be As Worn As The Most Worn Sector
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            if (sectors[sector].state != SectorInfo::State::Used || sectors[sector].damaged)
+                sectors[sector].eraseCount = maxEraseCount;
+
+            // Recovered Keys Are Committed Again So That A Normal Load Finds Them
+            if (sectors[sector].damaged)
+            {
+                markSectorDirty(sector);
+                report->damagedSectors++;
+            }
+        }
+
+        // Changes Flushed On Power Failure Replay After The Sectors They Followed
+        if (journalSectors > 0 && !loadJournal())
+            return 0;
+
+        // The Flush Can Name A Sector Whose Header Never Reached Flash, So New Sectors Must Be Numbered Past It
+        if (journalUsed)
+            nextSequence = std::max(nextSequence, journalSequence + 1);
+
+        // A Journal Flushed Before Any Sector Was Written Still Holds A Map
+        found = found || !keyValueMap.empty();
+
+        // Pops Leave No Deletion Records, So Entries Outside Each Queue Are Discarded Here
+        dropPoppedEntries();
+
+        // Power Loss During Compaction Can Leave No Sector To Open, So The Rest Of The Victim Is Moved By The Next Commit
+        size_t oldest = SIZE_MAX;
+        bool spare = sectors.size() < 2;
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            spare = spare || sectors[sector].state == SectorInfo::State::Free || sectors[sector].state == SectorInfo::State::Garbage;
+            if (sector != activeSector && sectors[sector].state == SectorInfo::State::Used && (oldest == SIZE_MAX || sectors[sector].sequence < sectors[oldest].sequence))
+                oldest = sector;
+        }
+
+        if (!spare && oldest != SIZE_MAX)
+        {
+            // Deletions In The Oldest Sector Shadow Nothing, So Those Not Queued For Commit Are Dropped To Free The Sector
+            bool keepDeletions = journalUsed;
+            for (const auto &info : sectors)
+                keepDeletions = keepDeletions || info.state == SectorInfo::State::Legacy;
+
+            for (auto it = keyValueMap.begin(); it != keyValueMap.end() && !keepDeletions;)
+            {
+                KeyEntry &entry = it->second;
+                if (entry.erased && !entry.dirty && entry.location != FLASHKV_NO_LOCATION && entry.location / flashSectorSize == oldest)
+                {
+                    setLocation(entry, FLASHKV_NO_LOCATION, 0);
+                    serialisedSize -= recordSize(it->first.size(), 0);
+                    it = keyValueMap.erase(it);
+                    continue;
+                }
+
+                ++it;
+            }
+
+            markSectorDirty(oldest);
+        }
+
+        stampVersions();
+
+        // Loading Replaces Every Value, So Bounded Latency Mode Needs Its Capacity Reserved Again
+        if (boundedLatency)
+            reserveBounded();
+
+        // Records Skipped After Corruption Can Only Be Salvaged By recoverMap()
+        bool skipped = false;
+        for (const auto &info : sectors)
+            skipped = skipped || info.skipped;
+
+        if (!found)
+            return 2;
+
+        return skipped ? 3 : 1;
+    }
+
+#ifndef FLASHKV_NO_LEGACY_FORMAT
+    bool FlashKV::loadLegacyMap()
+    {
+        size_t offset = FLASHKV_SIGNATURE_SIZE;
+        while (offset < flashSize)
+        {
+            auto deserializedPair = deserialiseLegacyKeyValuePair(offset);
+
+            if (!deserializedPair)
+                return false;
+
+            if (deserializedPair->first == 0)
+                break;
+
+            // Values Too Large For A Sector Cannot Be Carried Over
+            const KeyValue &keyValue = deserializedPair->second;
+            size_t size = recordSize(keyValue.first.size(), keyValue.second.size());
+            if (size <= flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE)
+            {
+                auto &entry = *keyValueMap.try_emplace(keyValue.first).first;
+                entry.second.value = keyValue.second;
+                entry.second.head = 0;
+                serialisedSize += size;
+                markDirty(entry);
+            }
+
+            offset += deserializedPair->first;
+        }
+
+        // The Old Map Is Kept Until Every Key Has Been Committed In The New Format
+        for (size_t sector = 0; sector < sectors.size() && sector * flashSectorSize < offset; sector++)
+            sectors[sector].state = SectorInfo::State::Legacy;
+
+        return true;
+    }
+#endif
+
+    bool FlashKV::readSectorHeader(size_t sector, const uint8_t *header)
+    {
+        SectorInfo &info = sectors[sector];
+        uint8_t buffer[FLASHKV_SECTOR_HEADER_SIZE];
+        if (!header && !readFlash(sector * flashSectorSize, buffer, sizeof(buffer)))
+            return false;
+
+        if (!header)
+            header = buffer;
+
+        uint32_t crc;
+        std::memcpy(&crc, header + 16, sizeof(uint32_t));
+        if (std::memcmp(header, FLASHKV_SECTOR_SIGNATURE, sizeof(FLASHKV_SECTOR_SIGNATURE)) == 0 && crc32(0, header, 16) == crc)
+        {
+            std::memcpy(&info.sequence, header + 4, sizeof(uint32_t));
+            std::memcpy(&info.eraseCount, header + 8, sizeof(uint32_t));
+            std::memcpy(&info.keyCount, header + 12, sizeof(uint32_t));
+            info.state = SectorInfo::State::Used;
+            return true;
+        }
+
+        // Anything Other Than A Fully Erased Sector Must Be Erased Before Use
+        auto blank = isBlank(sector * flashSectorSize, flashSectorSize);
+        if (!blank)
+            return false;
+
+        info.state = *blank ? SectorInfo::State::Free : SectorInfo::State::Garbage;
+        return true;
+    }
+
+    bool FlashKV::loadSectors(const Vector<size_t> &order, RecoveryReport *report)
+    {
+        // The Newest Header Holds The Key Count When It Was Opened, With Headroom For Keys Created In It Since
+        if (!order.empty())
+        {
+            size_t keyCount = std::min<size_t>(sectors[order.back()].keyCount, sectors.size() * flashSectorSize / recordSize(0, 0));
+            reserve(keyValueMap.size() + keyCount + keyCount / 4);
+        }
+
+#ifdef FLASHKV_PARALLEL_LOAD
+        // Parse Sectors Concurrently, Then Merge Them In Sequence Order
+        if (loadThreads > 1)
+        {
+            Vector<Vector<Record>> parsed(order.size());
+            Vector<RecoveryReport> reports(order.size());
+            if (!runParallel(order.size(), [&](size_t index)
+                             { return parseSector(order[index], parsed[index], report ? &reports[index] : nullptr); }))
+                return false;
+
+            for (size_t index = 0; index < order.size() && report; index++)
+            {
+                report->corruptRecords += reports[index].corruptRecords;
+                report->recoveredRecords += reports[index].recoveredRecords;
+            }
+
+            for (auto &records : parsed)
+            {
+                for (auto &record : records)
+                    applyRecord(record);
+
+                Vector<Record>().swap(records);
+            }
+
+            return true;
+        }
+#endif
+
+        // Records Are Applied As Each Sector Is Parsed
+        Vector<Record> records;
+        for (size_t sector : order)
+        {
+            records.clear();
+            if (!parseSector(sector, records, report))
+                return false;
+
+            for (auto &record : records)
+                applyRecord(record);
+        }
+
+        return true;
+    }
+
+    template <typename Task>
+    bool FlashKV::runParallel(size_t count, const Task &task)
+    {
+#ifdef FLASHKV_PARALLEL_LOAD
+        size_t threadCount = std::min(loadThreads, count);
+        if (threadCount > 1)
+        {
+            // Each Worker Takes The Next Index Until None Are Left Or One Has Failed
+            std::atomic<size_t> nextIndex{0};
+            std::atomic<bool> success{true};
+            auto worker = [&]()
+            {
+                for (size_t index = nextIndex++; index < count && success; index = nextIndex++)
+                    if (!task(index))
+                        success = false;
+            };
+
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < threadCount; i++)
+                workers.emplace_back(worker);
+
+            for (auto &worker : workers)
+                worker.join();
+
+            return success;
+        }
+#endif
+
+        for (size_t index = 0; index < count; index++)
+            if (!task(index))
+                return false;
+
+        return true;
+    }
+
+    bool FlashKV::parseSector(size_t sector, Vector<Record> &records, RecoveryReport *report)
+    {
+        SectorInfo &info = sectors[sector];
+        size_t base = sector * flashSectorSize;
+        size_t offset = FLASHKV_SECTOR_HEADER_SIZE;
+        bool closed = info.damaged;
+        while (offset + FLASHKV_RECORD_HEADER_SIZE <= flashSectorSize)
+        {
+            auto record = deserialiseKeyValuePair(base + offset, base + flashSectorSize);
+            if (!record)
+                return false;
+
+            if (record->status == RecordStatus::Valid)
+            {
+                if (report && info.damaged)
+                    report->recoveredRecords++;
+
+                offset += record->size;
+                records.push_back(std::move(*record));
+                continue;
+            }
+
+            // Batches Are Padded To A Page
+            if (record->status == RecordStatus::Blank && offset % programSize != 0)
+            {
+                offset = alignToProgram(offset);
+                continue;
+            }
+
+            // When Recovering, Resynchronise On The Next Valid Record, Which After A Blank Page Means Its Magic Was Damaged
+            if (report)
+            {
+                auto next = findRecord(base + offset + 1, base + flashSectorSize);
+                if (!next)
+                    return false;
+
+                if (record->status == RecordStatus::Corrupt || *next < base + flashSectorSize)
+                    report->corruptRecords++;
+
+                if (*next < base + flashSectorSize)
+                {
+                    info.damaged = true;
+                    closed = true;
+                    offset = *next - base;
+                    continue;
+                }
+            }
+
+            if (record->status == RecordStatus::Blank)
+                break;
+
+            // An Intact Record Later In The Same Page Means Damage, Where A Write Torn By Power Loss Leaves Nothing After It
+            size_t pageEnd = alignToProgram(offset + 1);
+            if (!report && !info.skipped)
+            {
+                auto next = findRecord(base + offset + 1, base + flashSectorSize);
+                if (!next)
+                    return false;
+
+                info.skipped = *next < base + pageEnd;
+            }
+
+            // A Torn Or Corrupt Record Spoils The Rest Of Its Page, So Parsing Resumes At The Next One
+            offset = pageEnd;
+        }
+
+        info.writeOffset = std::min(alignToProgram(offset), flashSectorSize);
+
+        // A Page Left Partially Programmed By A Power Loss, Or Stray Bits Further On, Cannot Be Appended To
+        if (!closed && info.writeOffset < flashSectorSize)
+        {
+            auto blank = isBlank(base + info.writeOffset, flashSectorSize - info.writeOffset);
+            if (!blank)
+                return false;
+
+            closed = !*blank;
+        }
+
+        if (closed)
+            info.writeOffset = flashSectorSize;
+
+        return true;
+    }
+
+    std::optional<size_t> FlashKV::findRecord(size_t offset, size_t limit)
+    {
+        uint8_t buffer[256];
+        while (offset + FLASHKV_RECORD_HEADER_SIZE <= limit)
+        {
+            size_t chunk = std::min(sizeof(buffer), limit - offset);
+            if (!readFlash(offset, buffer, chunk))
+                return std::nullopt;
+
+            // Try Every Magic Byte In The Chunk As The Start Of A Record
+            const uint8_t *magic = buffer;
+            while ((magic = static_cast<const uint8_t *>(std::memchr(magic, FLASHKV_RECORD_MAGIC, buffer + chunk - magic))))
+            {
+                size_t candidate = offset + (magic - buffer);
+                if (candidate + FLASHKV_RECORD_HEADER_SIZE > limit)
+                    return limit;
+
+                auto record = deserialiseKeyValuePair(candidate, limit);
+                if (!record)
+                    return std::nullopt;
+
+                if (record->status == RecordStatus::Valid)
+                    return candidate;
+
+                magic++;
+            }
+
+            offset += chunk;
+        }
+
+        return limit;
+    }
+
+    std::optional<bool> FlashKV::isBlank(size_t offset, size_t count)
+    {
+        // Let The Driver Check Without Transferring The Data Where It Can
+        if (driverCapabilities.blankCheck && !eraseInProgress)
+            return driver->blankCheck(flashAddress + offset, count);
+
+        uint8_t buffer[256];
+        while (count > 0)
+        {
+            size_t chunk = std::min(count, sizeof(buffer));
+            if (!readFlash(offset, buffer, chunk))
+                return std::nullopt;
+
+            if (!isErased(buffer, chunk))
+                return false;
+
+            offset += chunk;
+            count -= chunk;
+        }
+
+        return true;
+    }
+
+    void FlashKV::applyRecord(Record &record)
+    {
+        if (record.type == RecordType::Append)
+        {
+            applyAppendRecord(record);
+            return;
+        }
+
+        auto [it, inserted] = keyValueMap.try_emplace(record.keyValue.first);
+        KeyEntry &entry = it->second;
+        if (!inserted)
+            serialisedSize -= recordSize(it->first.size(), entry.size());
+
+        if (record.type == RecordType::Put)
+        {
+            entry.value = std::move(record.keyValue.second);
+            entry.erased = false;
+        }
+        else
+        {
+            entry.value.clear();
+            entry.erased = true;
+        }
+
+        // Keys Carried Over From A FlashKV 1.0 Map Are Superseded By Any Newer Record
+        entry.head = 0;
+        serialisedSize += recordSize(it->first.size(), entry.size());
+        setLocation(entry, record.offset, record.size);
+        entry.dirty = false;
+    }
+
+    void FlashKV::applyAppendRecord(Record &record)
+    {
+        const Bytes &payload = record.keyValue.second;
+        uint16_t limit;
+        uint32_t location;
+        std::memcpy(&limit, payload.data(), sizeof(uint16_t));
+        std::memcpy(&location, payload.data() + 2, sizeof(uint32_t));
+
+        // An Append Only Applies To The Record It Was Written After, Which Is Missing If That Record Was Lost
+        auto it = keyValueMap.find(record.keyValue.first);
+        if (it == keyValueMap.end() || it->second.erased || it->second.location != location)
+            return;
+
+        KeyEntry &entry = it->second;
+        serialisedSize -= recordSize(it->first.size(), entry.size());
+        appendValue(entry, payload.data() + FLASHKV_APPEND_HEADER_SIZE, payload.size() - FLASHKV_APPEND_HEADER_SIZE, limit);
+        serialisedSize += recordSize(it->first.size(), entry.size());
+        setLocation(entry, entry.location, entry.storedSize + record.size);
+    }
+
+    bool FlashKV::loadJournal()
+    {
+        size_t end = (sectors.size() + journalSectors) * flashSectorSize;
+        size_t offset = sectors.size() * flashSectorSize;
+        while (offset + FLASHKV_SECTOR_HEADER_SIZE <= end)
+        {
+            uint8_t header[FLASHKV_SECTOR_HEADER_SIZE];
+            if (!readFlash(offset, header, sizeof(header)))
+                return false;
+
+            uint32_t sequence, crc;
+            std::memcpy(&sequence, header + 4, sizeof(uint32_t));
+            std::memcpy(&crc, header + 16, sizeof(uint32_t));
+            if (std::memcmp(header, FLASHKV_JOURNAL_SIGNATURE, sizeof(FLASHKV_JOURNAL_SIGNATURE)) != 0 || crc32(0, header, 16) != crc)
+                break;
+
+            journalUsed = true;
+            journalSequence = sequence;
+            offset += sizeof(header);
+
+            // A Flush Cut Short By The Power Failing Ends At Its First Torn Record
+            while (offset + FLASHKV_RECORD_HEADER_SIZE <= end)
+            {
+                auto record = deserialiseKeyValuePair(offset, end);
+                if (!record)
+                    return false;
+
+                if (record->status != RecordStatus::Valid)
+                    break;
+
+                offset += record->size;
+                applyJournalRecord(*record, sequence);
+            }
+
+            offset = alignToProgram(offset);
+        }
+
+        // Anything Else Left In The Journal Blocks Further Flushes Until It Has Been Erased
+        journalOffset = std::min(offset, end);
+        if (journalOffset < end)
+        {
+            auto blank = isBlank(journalOffset, end - journalOffset);
+            if (!blank)
+                return false;
+
+            if (!*blank)
+            {
+                journalUsed = true;
+                journalOffset = end;
+            }
+        }
+
+        return true;
+    }
+
+    void FlashKV::applyJournalRecord(Record &record, uint32_t sequence)
+    {
+        // Records Committed To Sectors Opened After The Flush Are Newer Than The Journal
+        auto it = keyValueMap.find(record.keyValue.first);
+        if (it != keyValueMap.end() && it->second.location != FLASHKV_NO_LOCATION && sectors[it->second.location / flashSectorSize].sequence > sequence)
+            return;
+
+        if (it == keyValueMap.end())
+            it = keyValueMap.try_emplace(std::move(record.keyValue.first)).first;
+        else
+            serialisedSize -= recordSize(it->first.size(), it->second.size());
+
+        // The Key Keeps Its Location, Since The Log Record Stays Live Until The Change Is Committed
+        KeyEntry &entry = it->second;
+        entry.erased = record.type == RecordType::Delete;
+        entry.value = std::move(record.keyValue.second);
+        entry.head = 0;
+        serialisedSize += recordSize(it->first.size(), entry.size());
+        markDirty(*it);
+    }
+
+    bool FlashKV::writeJournal(size_t &offset, const uint8_t *data, size_t count)
+    {
+        while (count > 0)
+        {
+            size_t fill = offset % programSize;
+            size_t step = std::min(count, programSize - fill);
+            std::memcpy(journalBuffer.data() + fill, data, step);
+            offset += step;
+            data += step;
+            count -= step;
+
+            // Each Unit Is Programmed As Soon As It Is Full
+            if (offset % programSize == 0)
+            {
+                invertErased(journalBuffer.data(), programSize);
+                if (!driver->program(flashAddress + offset - programSize, journalBuffer.data(), programSize))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    void FlashKV::retireJournal()
+    {
+        if (!journalUsed || journalErasing || !dirtyEntries.empty() || hasWork(IoClass::Commit))
+            return;
+
+        for (size_t sector = sectors.size(); sector < sectors.size() + journalSectors; sector++)
+            queueErase(IoClass::Compaction, sector);
+
+        journalErasing = true;
+    }
+
+    void FlashKV::retireDamaged()
+    {
+        if (!dirtyEntries.empty() || hasWork(IoClass::Commit))
+            return;
+
+        // Sectors Read By recoverMap() Are Erased Once Their Keys Are Committed Elsewhere, So A Normal Load Stops Skipping Them
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            SectorInfo &info = sectors[sector];
+            if (!info.damaged || info.state != SectorInfo::State::Used || info.liveRecords > 0 || sector == activeSector)
+                continue;
+
+            info.damaged = false;
+            info.state = SectorInfo::State::Erasing;
+            info.eraseCount++;
+            queueErase(IoClass::Compaction, sector);
+        }
+    }
+
+    void FlashKV::retainSnapshot()
+    {
+        if (!snapshotDue())
+            return;
+
+        size_t size = sectors.size() * sizeof(SectorInfo);
+        uint8_t result = 2;
+        for (const auto &info : sectors)
+        {
+            if (info.state == SectorInfo::State::Legacy)
+            {
+                retainedUnfit = true;
+                return;
+            }
+
+            // The Copy Returns What A Load From Flash Memory Would, Including Records Skipped After Corruption
+            if (info.state == SectorInfo::State::Used)
+                result = info.skipped || result == 3 ? 3 : 1;
+        }
+
+        for (const auto &entry : keyValueMap)
+            size += FLASHKV_RETAINED_ENTRY_SIZE + entry.first.size() + entry.second.size();
+
+        invalidateSnapshot();
+        if (sizeof(RetainedHeader) + size > retainedSize)
+        {
+            retainedUnfit = true;
+            return;
+        }
+
+        uint8_t *data = retainedMemory + sizeof(RetainedHeader);
+        std::memcpy(data, sectors.data(), sectors.size() * sizeof(SectorInfo));
+        data += sectors.size() * sizeof(SectorInfo);
+        for (const auto &entry : keyValueMap)
+        {
+            uint16_t keySize = entry.first.size();
+            uint16_t valueSize = entry.second.size();
+            std::memcpy(data, &entry.second.location, sizeof(uint32_t));
+            std::memcpy(data + 4, &entry.second.storedSize, sizeof(uint32_t));
+            std::memcpy(data + 8, &keySize, sizeof(uint16_t));
+            std::memcpy(data + 10, &valueSize, sizeof(uint16_t));
+            data[12] = entry.second.erased;
+            std::copy(entry.first.begin(), entry.first.end(), data + FLASHKV_RETAINED_ENTRY_SIZE);
+            std::copy(entry.second.data(), entry.second.data() + valueSize, data + FLASHKV_RETAINED_ENTRY_SIZE + keySize);
+            data += FLASHKV_RETAINED_ENTRY_SIZE + keySize + valueSize;
+        }
+
+        RetainedHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.generation = ++retainedGeneration;
+        header.result = result;
+        header.size = size;
+        header.flashAddress = flashAddress;
+        header.flashSize = flashSize;
+        header.sectorCount = sectors.size();
+        header.programSize = programSize;
+        header.keyCount = keyValueMap.size();
+        header.activeSector = activeSector;
+        header.nextSequence = nextSequence;
+        header.journalOffset = journalOffset;
+        header.journalSequence = journalSequence;
+        header.journalUsed = journalUsed;
+
+        // The Signature Is Written Last, So A Reset Part Way Through Leaves No Valid Copy
+        const uint8_t *fields = reinterpret_cast<const uint8_t *>(&header) + 8;
+        header.crc = crc32(crc32(0, fields, sizeof(header) - 8), retainedMemory + sizeof(header), size);
+        std::memcpy(retainedMemory + 4, reinterpret_cast<const uint8_t *>(&header) + 4, sizeof(header) - 4);
+        std::memcpy(retainedMemory, FLASHKV_RETAINED_SIGNATURE, sizeof(FLASHKV_RETAINED_SIGNATURE));
+        retainedCurrent = true;
+    }
+
+    bool FlashKV::snapshotDue() const
+    {
+        // Only Committed State Is Copied, Since Changes Still In Memory Are Lost On Reset Anyway
+        return retainedMemory && !retainedCurrent && !retainedUnfit && dirtyEntries.empty() && !hasWork(IoClass::Commit);
+    }
+
+    std::optional<uint8_t> FlashKV::restoreSnapshot()
+    {
+        if (retainedSize < sizeof(RetainedHeader) || std::memcmp(retainedMemory, FLASHKV_RETAINED_SIGNATURE, sizeof(FLASHKV_RETAINED_SIGNATURE)) != 0)
+            return std::nullopt;
+
+        RetainedHeader header;
+        std::memcpy(&header, retainedMemory, sizeof(header));
+        if (header.size > retainedSize - sizeof(header) || header.flashAddress != flashAddress || header.flashSize != flashSize ||
+            header.sectorCount != sectors.size() || header.programSize != programSize)
+            return std::nullopt;
+
+        const uint8_t *fields = reinterpret_cast<const uint8_t *>(&header) + 8;
+        if (crc32(crc32(0, fields, sizeof(header) - 8), retainedMemory + sizeof(header), header.size) != header.crc)
+            return std::nullopt;
+
+        // Flash Memory Written Behind The Copy's Back Changes The Active Sector's Header Or Fills Its Next Program Unit,
+        // And Once The Active Sector Is Full It Opens A Sector The Copy Holds As Unused, With A Sequence Not Yet Issued
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            SectorInfo info;
+            std::memcpy(&info, retainedMemory + sizeof(header) + sector * sizeof(SectorInfo), sizeof(SectorInfo));
+            if (sector != header.activeSector && info.state == SectorInfo::State::Used)
+                continue;
+
+            uint8_t sectorHeader[FLASHKV_SECTOR_HEADER_SIZE];
+            uint32_t sequence, crc;
+            if (!readFlash(sector * flashSectorSize, sectorHeader, sizeof(sectorHeader)))
+                return std::nullopt;
+
+            std::memcpy(&sequence, sectorHeader + 4, sizeof(uint32_t));
+            std::memcpy(&crc, sectorHeader + 16, sizeof(uint32_t));
+            bool valid = std::memcmp(sectorHeader, FLASHKV_SECTOR_SIGNATURE, sizeof(FLASHKV_SECTOR_SIGNATURE)) == 0 && crc32(0, sectorHeader, 16) == crc;
+            if (sector != header.activeSector)
+            {
+                if (valid && sequence >= header.nextSequence)
+                    return std::nullopt;
+
+                continue;
+            }
+
+            if (!valid || sequence != info.sequence)
+                return std::nullopt;
+
+            if (info.writeOffset < flashSectorSize)
+            {
+                auto blank = isBlank(sector * flashSectorSize + info.writeOffset, programSize);
+                if (!blank || !*blank)
+                    return std::nullopt;
+            }
+        }
+
+        resetState();
+        const uint8_t *data = retainedMemory + sizeof(header);
+        std::memcpy(sectors.data(), data, sectors.size() * sizeof(SectorInfo));
+        data += sectors.size() * sizeof(SectorInfo);
+
+        // Live Counts Are Rebuilt As Keys Are Placed, And Erases Cut Short By The Reset Are Started Again
+        for (size_t sector = 0; sector < sectors.size(); sector++)
+        {
+            sectors[sector].liveRecords = 0;
+            sectors[sector].liveBytes = 0;
+            if (sectors[sector].state == SectorInfo::State::Erasing)
+                queueErase(IoClass::Compaction, sector);
+        }
+
+        reserve(header.keyCount);
+        for (size_t i = 0; i < header.keyCount; i++)
+        {
+            uint32_t location, storedSize;
+            uint16_t keySize, valueSize;
+            std::memcpy(&location, data, sizeof(uint32_t));
+            std::memcpy(&storedSize, data + 4, sizeof(uint32_t));
+            std::memcpy(&keySize, data + 8, sizeof(uint16_t));
+            std::memcpy(&valueSize, data + 10, sizeof(uint16_t));
+
+            const char *key = reinterpret_cast<const char *>(data + FLASHKV_RETAINED_ENTRY_SIZE);
+            const uint8_t *value = data + FLASHKV_RETAINED_ENTRY_SIZE + keySize;
+            auto it = keyValueMap.try_emplace(String(key, keySize)).first;
+            it->second.value.assign(value, value + valueSize);
+            it->second.head = 0;
+            it->second.erased = data[12] != 0;
+            setLocation(it->second, location, storedSize);
+            serialisedSize += recordSize(keySize, valueSize);
+            data += FLASHKV_RETAINED_ENTRY_SIZE + keySize + valueSize;
+        }
+
+        activeSector = header.activeSector;
+        nextSequence = header.nextSequence;
+        journalOffset = header.journalOffset;
+        journalSequence = header.journalSequence;
+        journalUsed = header.journalUsed;
+        retainedGeneration = header.generation;
+        retainedCurrent = true;
+        stampVersions();
+        if (boundedLatency)
+            reserveBounded();
+
+        return header.result;
+    }
+
+    void FlashKV::invalidateSnapshot()
+    {
+        if (retainedMemory)
+            std::memset(retainedMemory, 0, std::min(retainedSize, sizeof(FLASHKV_RETAINED_SIGNATURE)));
+
+        retainedCurrent = false;
+        retainedUnfit = false;
+    }
+
+    void FlashKV::buildCommit()
+    {
+        commitBuffer.clear();
+        IoQueue &queue = ioQueues[static_cast<size_t>(IoClass::Commit)];
+        queue.operations.clear();
+        queue.nextOperation = 0;
+
+        // Append Changed Keys Oldest First, Roughly A Sector At A Time
+        size_t processed = 0;
+        while (processed < dirtyEntries.size() && commitBuffer.size() < flashSectorSize)
+        {
+            KeyValueMap::value_type &entry = *dirtyEntries[processed];
+
+            // A Key Erased Before Reaching Flash Memory Needs No Record
+            if (entry.second.erased && entry.second.location == FLASHKV_NO_LOCATION)
+            {
+                entry.second.dirty = entry.second.queued = false;
+                if (!boundedLatency)
+                {
+                    serialisedSize -= recordSize(entry.first.size(), 0);
+                    keyValueMap.erase(keyValueMap.find(entry.first));
+                }
+
+                processed++;
+                continue;
+            }
+
+            if (entry.second.dirty)
+            {
+                size_t size = pendingRecordSize(entry);
+                if (!reserveSpace(size))
+                    break;
+
+                // Opening A Sector Ends The Key's Chain Of Appends, So The Whole Value Needs Room
+                if (pendingRecordSize(entry) > size && !reserveSpace(pendingRecordSize(entry)))
+                    break;
+
+                // Compaction While Making Room May Already Have Moved The Key
+                if (entry.second.dirty)
+                    appendRecord(entry);
+            }
+
+            entry.second.queued = false;
+            processed++;
+        }
+
+        dirtyEntries.erase(dirtyEntries.begin(), dirtyEntries.begin() + processed);
+        finishSegment();
+
+        // The Old Map Is Erased Once Every Key Has Been Committed In The New Format
+        if (dirtyEntries.empty())
+        {
+            for (size_t sector = 0; sector < sectors.size(); sector++)
+            {
+                if (sectors[sector].state != SectorInfo::State::Legacy)
+                    continue;
+
+                sectors[sector].state = SectorInfo::State::Erasing;
+                sectors[sector].eraseCount++;
+                queueErase(IoClass::Compaction, sector);
+            }
+        }
+
+#ifndef FLASHKV_NO_SCRUB
+        // A Scrub In Progress Restarts Its Current Sector Against The New Contents
+        scrubOffset = FLASHKV_SECTOR_HEADER_SIZE;
+        scrubRecords = 0;
+#endif
+    }
+
+    bool FlashKV::reserveSpace(size_t size)
+    {
+        // Records Committed After An Emergency Flush Go To A New Sector, So That They Replay After The Journal
+        if (activeSector != SIZE_MAX && sectors[activeSector].writeOffset + size <= flashSectorSize &&
+            (!journalUsed || sectors[activeSector].sequence > journalSequence))
+            return true;
+
+        if (!openSector())
+            return false;
+
+        // Cold Records Moved By Wear Levelling Can Fill The New Sector
+        if (sectors[activeSector].writeOffset + size > flashSectorSize && sectors[activeSector].writeOffset > FLASHKV_SECTOR_HEADER_SIZE && !openSector())
+            return false;
+
+        return sectors[activeSector].writeOffset + size <= flashSectorSize && (!journalUsed || sectors[activeSector].sequence > journalSequence);
+    }
+
+    bool FlashKV::openSector()
+    {
+        // Prefer A Sector That Is Already Erased, A Single Sector Region Is Reused In Place
+        size_t sector = SIZE_MAX;
+        if (sectors.size() == 1)
+            sector = sectors[0].state != SectorInfo::State::Erasing ? 0 : SIZE_MAX;
+
+        // Writes Go To The Least Worn Sector, Unless Cold Data Is About To Be Moved Into The Most Worn One
+        size_t coldSector = sectors.size() > 1 ? findColdSector() : SIZE_MAX;
+        for (auto state : {SectorInfo::State::Free, SectorInfo::State::Garbage})
+        {
+            for (size_t i = 0; i < sectors.size(); i++)
+            {
+                if (sectors[i].state != state)
+                    continue;
+
+                uint32_t wear = sectors[i].eraseCount;
+                if (sector == SIZE_MAX || (coldSector != SIZE_MAX ? wear > sectors[sector].eraseCount : wear < sectors[sector].eraseCount))
+                    sector = i;
+            }
+
+            if (sector != SIZE_MAX)
+                break;
+        }
+
+        // A Compaction Interrupted Before Its Erase Leaves Every Sector In Use, But The Victim Holds Nothing Live
+        for (size_t i = 0; i < sectors.size() && sector == SIZE_MAX; i++)
+            if (i != activeSector && sectors[i].state == SectorInfo::State::Used && sectors[i].liveRecords == 0)
+                sector = i;
+
+        if (sector == SIZE_MAX)
+            return false;
+
+        // That Sector Can Also Be The Coldest, But The Sector Being Opened Is Never Compacted, So The Move Waits
+        if (coldSector == sector)
+            coldSector = SIZE_MAX;
+
+        finishSegment();
+
+        SectorInfo &info = sectors[sector];
+        bool rewrite = sectors.size() == 1 && info.state == SectorInfo::State::Used;
+        if (info.state != SectorInfo::State::Free)
+        {
+            queueErase(IoClass::Commit, sector);
+            info.eraseCount++;
+        }
+
+        info.state = SectorInfo::State::Used;
+        info.sequence = nextSequence++;
+        info.keyCount = static_cast<uint32_t>(std::min<size_t>(keyValueMap.size(), UINT32_MAX));
+        info.writeOffset = FLASHKV_SECTOR_HEADER_SIZE;
+        info.damaged = info.skipped = false;
+
+        // The Header Is Programmed Together With The First Records
+        uint8_t header[FLASHKV_SECTOR_HEADER_SIZE] = {};
+        std::memcpy(header, FLASHKV_SECTOR_SIGNATURE, sizeof(FLASHKV_SECTOR_SIGNATURE));
+        std::memcpy(header + 4, &info.sequence, sizeof(uint32_t));
+        std::memcpy(header + 8, &info.eraseCount, sizeof(uint32_t));
+        std::memcpy(header + 12, &info.keyCount, sizeof(uint32_t));
+        uint32_t crc = crc32(0, header, 16);
+        std::memcpy(header + 16, &crc, sizeof(uint32_t));
+
+        segmentStart = commitBuffer.size();
+        segmentOffset = sector * flashSectorSize;
+        commitBuffer.insert(commitBuffer.end(), header, header + sizeof(header));
+        activeSector = sector;
+
+        if (rewrite)
+        {
+            collectSector(sector);
+            return true;
+        }
+
+        // Opening The Last Erasable Sector Compacts Another One, So That One Is Always Available
+        size_t room = flashSectorSize - info.writeOffset;
+        size_t victim = coldSector != SIZE_MAX && movedSize(coldSector) <= room ? coldSector : SIZE_MAX;
+        if (victim == SIZE_MAX)
+        {
+            size_t spare = 0;
+            for (const auto &other : sectors)
+                spare += other.state == SectorInfo::State::Free || other.state == SectorInfo::State::Garbage ||
+                         (erasedPool > 0 && other.state == SectorInfo::State::Erasing);
+
+            if (spare >= std::max<size_t>(erasedPool, 1))
+                return true;
+
+            // Topping Up The Erased Pool Is Only Worth Copying Sectors That Are Mostly Dead
+            victim = selectVictim(room);
+            if (spare > 0 && victim != SIZE_MAX && sectors[victim].liveBytes * 2 > flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE)
+                return true;
+        }
+        else
+            statistics.wearLevelMoves++;
+
+        if (victim != SIZE_MAX)
+        {
+            collectSector(victim);
+            sectors[victim].state = SectorInfo::State::Erasing;
+            sectors[victim].eraseCount++;
+            queueErase(IoClass::Compaction, victim);
+            statistics.compactions++;
+        }
+
+        return true;
+    }
+
+    size_t FlashKV::selectVictim(size_t room) const
+    {
+        // Cost-Benefit Score: Space Reclaimed Times Age, Over The Cost Of Reading And Copying The Live Records
+        size_t victim = SIZE_MAX;
+        double bestScore = 0;
+        double usable = static_cast<double>(flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE);
+        for (size_t i = 0; i < sectors.size(); i++)
+        {
+            const SectorInfo &info = sectors[i];
+            if (i == activeSector || info.state != SectorInfo::State::Used)
+                continue;
+
+            double utilisation = std::min(info.liveBytes / usable, 1.0);
+            double age = static_cast<double>(nextSequence - info.sequence);
+            double score = (1 - utilisation) * age / (1 + utilisation);
+
+            // Fully Live Sectors Score Zero, So Ties Fall Back To The Oldest Sector
+            if (victim == SIZE_MAX || score > bestScore || (score == bestScore && info.sequence < sectors[victim].sequence))
+            {
+                // Keys Changed Since Their Last Commit Move With Their New Values, Which Can Outgrow The Room Left
+                if (movedSize(i) > room)
+                    continue;
+
+                victim = i;
+                bestScore = score;
+            }
+        }
+
+        return victim;
+    }
+
+    size_t FlashKV::movedSize(size_t sector) const
+    {
+        size_t size = 0;
+        for (const auto &entry : keyValueMap)
+            if (entry.second.location != FLASHKV_NO_LOCATION && entry.second.location / flashSectorSize == sector)
+                size += recordSize(entry.first.size(), entry.second.size());
+
+        return size;
+    }
+
+    size_t FlashKV::findColdSector() const
+    {
+        if (maxEraseSkew == 0)
+            return SIZE_MAX;
+
+        // Records That Never Change Pin The Least Worn Sector Holding Them
+        size_t coldest = SIZE_MAX;
+        uint32_t maxEraseCount = 0;
+        for (size_t i = 0; i < sectors.size(); i++)
+        {
+            const SectorInfo &info = sectors[i];
+            maxEraseCount = std::max(maxEraseCount, info.eraseCount);
+            if (i != activeSector && info.state == SectorInfo::State::Used && (coldest == SIZE_MAX || info.eraseCount < sectors[coldest].eraseCount))
+                coldest = i;
+        }
+
+        return coldest != SIZE_MAX && maxEraseCount - sectors[coldest].eraseCount > maxEraseSkew ? coldest : SIZE_MAX;
+    }
+
+    void FlashKV::collectSector(size_t sector)
+    {
+        // Deletion Records Are Only Needed While Older Records For The Key Could Still Be Read
+        bool keepDeletions = journalUsed;
+        for (const auto &other : sectors)
+            keepDeletions = keepDeletions || other.state == SectorInfo::State::Legacy || other.state == SectorInfo::State::Erasing ||
+                            (other.state == SectorInfo::State::Used && other.sequence < sectors[sector].sequence);
+
+        for (auto it = keyValueMap.begin(); it != keyValueMap.end();)
+        {
+            KeyEntry &entry = it->second;
+            if (entry.location == FLASHKV_NO_LOCATION || entry.location / flashSectorSize != sector)
+            {
+                ++it;
+                continue;
+            }
+
+            // A Deletion Still Waiting To Be Committed Is Written Out When The Victim's Erase May Be Deferred
+            if (entry.erased && !keepDeletions && !(entry.queued && erasedPool > 0))
+            {
+                setLocation(entry, FLASHKV_NO_LOCATION, 0);
+                if (!entry.queued && !boundedLatency)
+                {
+                    serialisedSize -= recordSize(it->first.size(), 0);
+                    it = keyValueMap.erase(it);
+                    continue;
+                }
+            }
+            else
+            {
+                // Moved Keys Are Written Whole, Even When Rewriting The Sector Their Appends Were In
+                entry.appendedSize = 0;
+                appendRecord(*it);
+            }
+
+            ++it;
+        }
+    }
+
+    void FlashKV::appendRecord(KeyValueMap::value_type &entry)
+    {
+        SectorInfo &info = sectors[activeSector];
+        uint32_t location = activeSector * flashSectorSize + info.writeOffset;
+
+        // Records For The Active Sector Are Programmed Together As One Run Of Pages
+        if (segmentStart == SIZE_MAX)
+        {
+            segmentStart = commitBuffer.size();
+            segmentOffset = location;
+        }
+
+        // Appends Extend The Key's Records In The Active Sector, Anywhere Else The Whole Value Is Written
+        KeyEntry &key = entry.second;
+        size_t size = pendingRecordSize(entry);
+        if (key.appendedSize > 0 && key.location != FLASHKV_NO_LOCATION && key.location / flashSectorSize == activeSector)
+        {
+            serialiseAppend(entry.first, key);
+            setLocation(key, key.location, key.storedSize + size);
+        }
+        else
+        {
+            serialiseKeyValuePair(entry.first, key);
+            setLocation(key, location, size);
+        }
+
+        info.writeOffset += size;
+        key.appendedSize = 0;
+        key.dirty = false;
+    }
+
+    size_t FlashKV::pendingRecordSize(const KeyValueMap::value_type &entry) const
+    {
+        const KeyEntry &key = entry.second;
+        if (key.appendedSize > 0 && key.location != FLASHKV_NO_LOCATION && key.location / flashSectorSize == activeSector)
+            return recordSize(entry.first.size(), FLASHKV_APPEND_HEADER_SIZE + key.appendedSize);
+
+        return recordSize(entry.first.size(), key.size());
+    }
+
+    void FlashKV::finishSegment()
+    {
+        if (segmentStart == SIZE_MAX)
+            return;
+
+        // Pad To A Whole Program Unit With Erased Bytes
+        while ((commitBuffer.size() - segmentStart) % programSize != 0)
+            commitBuffer.push_back(FLASHKV_ERASED_VALUE);
+
+        // Program In The Largest Transfers The Driver Accepts, Or A Page At A Time Without Crossing Page Boundaries
+        IoQueue &queue = ioQueues[static_cast<size_t>(IoClass::Commit)];
+        size_t maxTransfer = std::max<size_t>(driverCapabilities.maxTransferSize / programSize, 1) * programSize;
+        size_t end = commitBuffer.size() - segmentStart;
+        for (size_t offset = 0; offset < end;)
+        {
+            size_t address = segmentOffset + offset;
+            size_t size = driverCapabilities.maxTransferSize ? maxTransfer : flashPageSize - address % flashPageSize;
+            size = std::min(size, end - offset);
+            queue.operations.push_back({FlashOperation::Type::Program, address, size, segmentStart + offset});
+            offset += size;
+        }
+
+        SectorInfo &info = sectors[segmentOffset / flashSectorSize];
+        info.writeOffset = std::min(alignToProgram(info.writeOffset), flashSectorSize);
+        segmentStart = SIZE_MAX;
+    }
+
+    void FlashKV::setLocation(KeyEntry &entry, uint32_t location, size_t size)
+    {
+        // The Previous Record Becomes Dead Space In Its Sector
+        if (entry.location != FLASHKV_NO_LOCATION)
+        {
+            SectorInfo &info = sectors[entry.location / flashSectorSize];
+            info.liveRecords--;
+            info.liveBytes -= entry.storedSize;
+        }
+
+        entry.location = location;
+        entry.storedSize = location != FLASHKV_NO_LOCATION ? static_cast<uint32_t>(size) : 0;
+        if (location != FLASHKV_NO_LOCATION)
+        {
+            SectorInfo &info = sectors[location / flashSectorSize];
+            info.liveRecords++;
+            info.liveBytes += size;
+        }
+    }
+
+    void FlashKV::markDirty(KeyValueMap::value_type &entry)
+    {
+        entry.second.dirty = true;
+        if (!entry.second.queued)
+        {
+            entry.second.queued = true;
+            dirtyEntries.push_back(&entry);
+        }
+    }
+
+    void FlashKV::markSectorDirty(size_t sector)
+    {
+        for (auto &entry : keyValueMap)
+        {
+            // Records In A Damaged Or Closed Sector Cannot Be Extended
+            if (entry.second.location != FLASHKV_NO_LOCATION && entry.second.location / flashSectorSize == sector)
+            {
+                entry.second.appendedSize = 0;
+                markDirty(entry);
+            }
+        }
+    }
+
+    void FlashKV::beginChange(KeyEntry &entry)
+    {
+        entry.version.store(versionStamp + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void FlashKV::endChange(KeyEntry &entry)
+    {
+        // Versions Come From One Counter For The Whole Map, So A Key Dropped And Written Again Never Repeats One
+        versionStamp += 2;
+        entry.version.store(versionStamp, std::memory_order_release);
+    }
+
+    void FlashKV::stampVersions()
+    {
+        // Versions Carry On Across Loads, So One Read Before A Reload Never Matches A Value Loaded By It
+        versionStamp += 2;
+        for (auto &entry : keyValueMap)
+            entry.second.version.store(versionStamp, std::memory_order_relaxed);
+    }
+
+    size_t FlashKV::recordSize(size_t keySize, size_t valueSize) const
+    {
+        return FLASHKV_RECORD_HEADER_SIZE + keySize + valueSize;
+    }
+
+    size_t FlashKV::capacity() const
+    {
+        // One Sector Is Kept Free For Compaction, And Padding Can Waste Up To A Program Unit Per Sector
+        size_t usable = flashSectorSize - FLASHKV_SECTOR_HEADER_SIZE - std::min(programSize, flashSectorSize / 2);
+        return sectors.size() > 1 ? (sectors.size() - 1) * usable : usable * sectors.size();
+    }
+
+    size_t FlashKV::alignToProgram(size_t offset) const
+    {
+        return (offset + programSize - 1) / programSize * programSize;
+    }
+
+    void FlashKV::queueErase(IoClass ioClass, size_t sector)
+    {
+        // A Drained Queue Starts Again From The Front, So It Never Holds More Than The Work Pending At Once
+        IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+        auto &operations = queue.operations;
+        if (queue.nextOperation >= operations.size())
+        {
+            operations.clear();
+            queue.nextOperation = 0;
+        }
+
+        // Contiguous Sectors In The Same Block Are Erased Together, Unless Each Erase Runs Asynchronously
+        size_t offset = sector * flashSectorSize;
+        size_t blockSize = driverCapabilities.eraseBlockSize;
+        if (blockSize > flashSectorSize && !driverCapabilities.asyncErase && operations.size() > queue.nextOperation)
+        {
+            FlashOperation &last = operations.back();
+            if (last.type == FlashOperation::Type::Erase && last.offset + last.size == offset &&
+                (flashAddress + last.offset) / blockSize == (flashAddress + offset) / blockSize)
+            {
+                last.size += flashSectorSize;
+                return;
+            }
+        }
+
+        operations.push_back({FlashOperation::Type::Erase, offset, flashSectorSize, 0});
+    }
+
+    bool FlashKV::runOperation(const FlashOperation &operation)
+    {
+        invalidateSnapshot();
+        uint64_t start = clockFunction ? clockFunction() : 0;
+
+        bool success;
+        if (operation.type == FlashOperation::Type::Erase && driverCapabilities.asyncErase)
+            success = eraseInProgress = driver->eraseStart(flashAddress + operation.offset, operation.size);
+        else if (operation.type == FlashOperation::Type::Erase)
+        {
+            // A Whole Block Is Erased In One Command, Anything Else A Sector At A Time
+            size_t step = operation.size == driverCapabilities.eraseBlockSize ? operation.size : flashSectorSize;
+            success = true;
+            for (size_t offset = 0; success && offset < operation.size; offset += step)
+                success = driver->erase(flashAddress + operation.offset + offset, step);
+        }
+        else
+            success = programFlash(operation.offset, commitBuffer.data() + operation.bufferOffset, operation.size);
+
+        if (clockFunction)
+        {
+            uint64_t &worstMicros = operation.type == FlashOperation::Type::Erase ? worstEraseMicros : worstProgramMicros;
+            worstMicros = std::max(worstMicros, clockFunction() - start);
+        }
+
+        if (operation.type == FlashOperation::Type::Erase)
+        {
+            statistics.sectorErases += operation.size / flashSectorSize;
+            if (eraseClass == IoClass::Commit)
+                statistics.commitErases += operation.size / flashSectorSize;
+            wearWindowErases += operation.size / flashSectorSize;
+        }
+        else
+        {
+            statistics.bytesProgrammed += operation.size;
+            wearWindowBytes += operation.size;
+        }
+
+        return success;
+    }
+
+    void FlashKV::completeOperation(const FlashOperation &operation)
+    {
+        if (operation.type != FlashOperation::Type::Erase)
+            return;
+
+        // Sectors Erased By Compaction Can Be Opened Again, And The Journal Is Empty Once Its Last Sector Is Erased
+        for (size_t offset = operation.offset; offset < operation.offset + operation.size; offset += flashSectorSize)
+        {
+            if (offset / flashSectorSize >= sectors.size())
+            {
+                if (offset / flashSectorSize == sectors.size() + journalSectors - 1)
+                {
+                    journalOffset = sectors.size() * flashSectorSize;
+                    journalUsed = false;
+                    journalErasing = false;
+                }
+
+                continue;
+            }
+
+            SectorInfo &info = sectors[offset / flashSectorSize];
+            if (info.state == SectorInfo::State::Erasing)
+            {
+                info.state = SectorInfo::State::Free;
+                info.writeOffset = 0;
+            }
+        }
+    }
+
+    bool FlashKV::runQueue(IoClass ioClass)
+    {
+        IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+        bool empty = queue.nextOperation >= queue.operations.size();
+        if (!empty && !enterExclusive())
+            return false;
+
+        while (queue.nextOperation < queue.operations.size())
+        {
+            const FlashOperation &operation = queue.operations[queue.nextOperation];
+            eraseClass = ioClass;
+            if (!runOperation(operation))
+            {
+                leaveExclusive();
+                abandonQueue(ioClass);
+                return false;
+            }
+
+            if (eraseInProgress)
+                finishErase();
+            else
+            {
+                completeOperation(operation);
+                queue.nextOperation++;
+            }
+        }
+
+        leaveExclusive();
+        if (ioClass == IoClass::Commit && !empty)
+            statistics.commits++;
+
+        return true;
+    }
+
+    bool FlashKV::enterExclusive()
+    {
+        if (!exclusive)
+            exclusive = driver->beginExclusive();
+
+        return exclusive;
+    }
+
+    void FlashKV::leaveExclusive()
+    {
+        if (exclusive)
+            driver->endExclusive();
+
+        exclusive = false;
+    }
+
+    void FlashKV::abandonQueue(IoClass ioClass)
+    {
+        IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+        size_t previous = SIZE_MAX;
+        for (size_t i = queue.nextOperation; i < queue.operations.size(); i++)
+        {
+            const FlashOperation &operation = queue.operations[i];
+            for (size_t sector = operation.offset / flashSectorSize; sector * flashSectorSize < operation.offset + operation.size; sector++)
+            {
+                if (sector == previous)
+                    continue;
+
+                // A Journal That Failed To Erase Is Retried Once Nothing Else Is Pending
+                if (sector >= sectors.size())
+                {
+                    journalErasing = false;
+                    journalOffset = (sectors.size() + journalSectors) * flashSectorSize;
+                    previous = sector;
+                    continue;
+                }
+
+                // Unfinished Sectors Are Closed And Their Keys Committed Again Elsewhere
+                if (ioClass == IoClass::Commit)
+                {
+                    sectors[sector].writeOffset = flashSectorSize;
+                    markSectorDirty(sector);
+                }
+                else
+                    sectors[sector].state = SectorInfo::State::Garbage;
+
+                previous = sector;
+            }
+        }
+
+        queue.operations.clear();
+        queue.nextOperation = 0;
+    }
+
+    void FlashKV::finishErase()
+    {
+        if (!eraseInProgress)
+            return;
+
+        while (driver->busy())
+            ;
+
+        eraseInProgress = false;
+        IoQueue &queue = ioQueues[static_cast<size_t>(eraseClass)];
+        completeOperation(queue.operations[queue.nextOperation]);
+        queue.nextOperation++;
+    }
+
+    bool FlashKV::readFlash(size_t offset, uint8_t *data, size_t count)
+    {
+        size_t maxTransfer = driverCapabilities.maxTransferSize ? driverCapabilities.maxTransferSize : count;
+        for (size_t done = 0; done < count;)
+        {
+            // Only Suspend When An Erase Is Running, Which Also Keeps Concurrent Loads Free Of Shared State
+            size_t size = std::min(maxTransfer, count - done);
+            bool success = eraseInProgress ? priorityRead(flashAddress + offset + done, data + done, size)
+                                           : driver->read(flashAddress + offset + done, data + done, size);
+            if (!success)
+                return false;
+
+            done += size;
+        }
+
+        invertErased(data, count);
+        return true;
+    }
+
+    bool FlashKV::programFlash(size_t offset, const uint8_t *data, size_t count)
+    {
+        if (driverCapabilities.erasedValue == FLASHKV_ERASED_VALUE)
+            return driver->program(flashAddress + offset, data, count);
+
+        programBuffer.assign(data, data + count);
+        invertErased(programBuffer.data(), count);
+        return driver->program(flashAddress + offset, programBuffer.data(), count);
+    }
+
+    void FlashKV::invertErased(uint8_t *data, size_t count) const
+    {
+        // Records Are Laid Out For Flash That Erases To 0xFF, So Other Parts See Every Byte Inverted
+        uint8_t mask = driverCapabilities.erasedValue ^ FLASHKV_ERASED_VALUE;
+        if (mask == 0)
+            return;
+
+        for (size_t i = 0; i < count; i++)
+            data[i] ^= mask;
+    }
+
+    bool FlashKV::hasWork(IoClass ioClass) const
+    {
+        if (ioClass == IoClass::Scrub)
+#ifndef FLASHKV_NO_SCRUB
+            return scrubActive;
+#else
+            return false;
+#endif
+
+        const IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+        return queue.nextOperation < queue.operations.size();
+    }
+
+    std::optional<IoClass> FlashKV::nextIoClass()
+    {
+        uint64_t now = clockFunction ? clockFunction() : 0;
+        for (size_t i = 0; i < static_cast<size_t>(IoClass::Count); i++)
+        {
+            IoClass ioClass = static_cast<IoClass>(i);
+            if (!hasWork(ioClass))
+                continue;
+
+            // Compacted Sectors Are Only Erased Once Their Records Have Been Moved, And Scrubbing Verifies
+            // Committed Data, So Both Wait For Commits To Finish
+            if (ioClass != IoClass::Commit && hasWork(IoClass::Commit))
+                continue;
+
+            // Erases Left By Compaction And For The Erased Pool Are Charged To The Wear Budget Like Commits
+            IoQueue &queue = ioQueues[i];
+            if (ioClass == IoClass::Compaction && !withinWearBudget(queue.operations[queue.nextOperation].size / flashSectorSize, 0))
+                continue;
+
+            // Refill The Token Bucket And Skip Classes That Have Used Their Share
+            if (queue.bytesPerSecond > 0 && clockFunction)
+            {
+                int64_t burst = std::max(queue.bytesPerSecond, flashSectorSize);
+                uint64_t elapsed = now - queue.lastRefill;
+                int64_t refill = elapsed >= 1000000 ? burst : static_cast<int64_t>(elapsed * queue.bytesPerSecond / 1000000);
+                if (refill > 0)
+                {
+                    queue.tokens = std::min(burst, queue.tokens + refill);
+                    queue.lastRefill = now;
+                }
+
+                if (queue.tokens <= 0)
+                    continue;
+            }
+
+            return ioClass;
+        }
+
+        return std::nullopt;
+    }
+
+    bool FlashKV::runStep(IoClass ioClass)
+    {
+        IoQueue &queue = ioQueues[static_cast<size_t>(ioClass)];
+#ifndef FLASHKV_NO_SCRUB
+        if (ioClass == IoClass::Scrub)
+        {
+            uint64_t start = clockFunction ? clockFunction() : 0;
+            queue.tokens -= scrubStep();
+            if (clockFunction)
+                worstReadMicros = std::max(worstReadMicros, clockFunction() - start);
+
+            return true;
+        }
+#endif
+
+        const FlashOperation &operation = queue.operations[queue.nextOperation];
+        eraseClass = ioClass;
+        if (!runOperation(operation))
+        {
+            abandonQueue(ioClass);
+            return false;
+        }
+
+        queue.tokens -= operation.size;
+        if (eraseInProgress)
+            return true;
+
+        completeOperation(operation);
+        queue.nextOperation++;
+        if (ioClass == IoClass::Commit && !hasWork(IoClass::Commit))
+            statistics.commits++;
+
+        return true;
+    }
+
+#ifndef FLASHKV_NO_SCRUB
+    size_t FlashKV::scrubStep()
+    {
+        // Skip Over Sectors That Hold No Records
+        while (scrubSector < sectors.size() && sectors[scrubSector].state != SectorInfo::State::Used)
+        {
+            scrubSector++;
+            scrubOffset = FLASHKV_SECTOR_HEADER_SIZE;
+            scrubRecords = 0;
+            scrubHeaderChecked = false;
+        }
+
+        if (scrubSector >= sectors.size())
+        {
+            scrubActive = false;
+            return 0;
+        }
+
+        SectorInfo &info = sectors[scrubSector];
+        size_t base = scrubSector * flashSectorSize;
+        bool corrupt = false;
+
+        // The First Step In Each Sector Checks Its Header, Without Which None Of Its Records Would Load
+        if (!scrubHeaderChecked)
+        {
+            uint8_t header[FLASHKV_SECTOR_HEADER_SIZE];
+            uint32_t sequence, crc;
+            corrupt = !readFlash(base, header, sizeof(header));
+            std::memcpy(&sequence, header + 4, sizeof(uint32_t));
+            std::memcpy(&crc, header + 16, sizeof(uint32_t));
+            corrupt = corrupt || std::memcmp(header, FLASHKV_SECTOR_SIGNATURE, sizeof(FLASHKV_SECTOR_SIGNATURE)) != 0 ||
+                      sequence != info.sequence || crc32(0, header, 16) != crc;
+
+            scrubHeaderChecked = !corrupt;
+            if (!corrupt)
+                return FLASHKV_SECTOR_HEADER_SIZE;
+        }
+        else if (scrubOffset + FLASHKV_RECORD_HEADER_SIZE <= info.writeOffset)
+        {
+            // Anything Unreadable Is Treated As A Mismatch
+            auto record = deserialiseKeyValuePair(base + scrubOffset, base + info.writeOffset);
+            corrupt = !record;
+
+            if (record && record->status == RecordStatus::Blank && scrubOffset % programSize != 0)
+            {
+                scrubOffset = alignToProgram(scrubOffset);
+                return FLASHKV_RECORD_HEADER_SIZE;
+            }
+
+            // A Corrupt Record Spoils The Rest Of Its Page, As When Loading
+            if (record && record->status == RecordStatus::Corrupt)
+            {
+                scrubOffset = alignToProgram(scrubOffset + 1);
+                return FLASHKV_RECORD_HEADER_SIZE;
+            }
+
+            if (record && record->status == RecordStatus::Valid)
+            {
+                // Only The Latest Record For Each Key Is Compared With The Map
+                auto it = keyValueMap.find(record->keyValue.first);
+                if (it != keyValueMap.end() && it->second.location == base + scrubOffset)
+                {
+                    // The First Of A Chain Of Appends Holds Only Part Of The Value, Every Record Has Its Own Checksum
+                    const Bytes &stored = record->keyValue.second;
+                    bool chained = it->second.storedSize != record->size;
+                    bool matches = it->second.erased ? record->type == RecordType::Delete
+                                                     : record->type == RecordType::Put &&
+                                                           (chained || std::equal(stored.begin(), stored.end(), it->second.data(), it->second.data() + it->second.size()));
+                    if (!matches)
+                    {
+                        it->second.appendedSize = 0;
+                        markDirty(*it);
+                    }
+
+                    scrubRecords++;
+                }
+
+                scrubOffset += record->size;
+                return record->size;
+            }
+        }
+
+        // Without A Valid Header None Of The Sector Would Load, So It Is Closed
+        if (corrupt && !scrubHeaderChecked)
+            info.writeOffset = flashSectorSize;
+
+        // Every Key Located In The Sector Must Have Been Found, Otherwise They Are All Committed Again
+        if (corrupt || scrubRecords != info.liveRecords)
+            markSectorDirty(scrubSector);
+
+        scrubSector++;
+        scrubOffset = FLASHKV_SECTOR_HEADER_SIZE;
+        scrubRecords = 0;
+        scrubHeaderChecked = false;
+        return FLASHKV_RECORD_HEADER_SIZE;
+    }
+#endif
+
+    bool FlashKV::admitCommit()
+    {
+        if (wearBudgetErases == 0 && wearBudgetBytes == 0)
+            return true;
+
+        // Estimate The Commit From The Records Waiting To Be Appended
+        size_t bytes = 0;
+        for (const auto *entry : dirtyEntries)
+            bytes += recordSize(entry->first.size(), entry->second.size());
+
+        bytes = std::min(alignToProgram(bytes), flashSectorSize);
+        bool overflows = activeSector == SIZE_MAX || sectors[activeSector].writeOffset + bytes > flashSectorSize;
+        uint32_t erases = 0;
+        if (bytes > 0 && overflows)
+        {
+            // The Sector Opened Needs Erasing Unless One Is Already Erased, And Can Set Off A Compaction Or A Wear
+            // Levelling Move That Copies Up To A Sector Of Records And Erases Another Sector Afterwards
+            size_t erased = 0, spare = 0;
+            for (const auto &info : sectors)
+            {
+                erased += info.state == SectorInfo::State::Free;
+                spare += info.state == SectorInfo::State::Free || info.state == SectorInfo::State::Garbage ||
+                         (erasedPool > 0 && info.state == SectorInfo::State::Erasing);
+            }
+
+            erases = erased > 0 ? 0 : 1;
+            if (spare <= std::max<size_t>(erasedPool, 1) || findColdSector() != SIZE_MAX)
+            {
+                erases++;
+                bytes += flashSectorSize;
+            }
+        }
+
+        if (!withinWearBudget(erases, bytes))
+        {
+            if (!statistics.throttled)
+                statistics.throttledCommits++;
+
+            statistics.throttled = true;
+            return false;
+        }
+
+        statistics.throttled = false;
+        return true;
+    }
+
+    bool FlashKV::withinWearBudget(uint32_t erases, size_t bytes)
+    {
+        if ((wearBudgetErases == 0 && wearBudgetBytes == 0) || !clockFunction)
+            return true;
+
+        uint64_t now = clockFunction();
+        if (now - wearWindowStart >= wearWindowMicros)
+        {
+            wearWindowStart = now;
+            wearWindowErases = 0;
+            wearWindowBytes = 0;
+        }
+
+        // The First Work In A Window Always Runs, So Nothing Is Held Back Indefinitely
+        bool windowEmpty = wearWindowErases == 0 && wearWindowBytes == 0;
+        bool overBudget = (wearBudgetErases > 0 && wearWindowErases + erases > wearBudgetErases) ||
+                          (wearBudgetBytes > 0 && wearWindowBytes + bytes > wearBudgetBytes);
+
+        return windowEmpty || !overBudget;
+    }
+
+    void FlashKV::fillRecordHeader(uint8_t *header, const String &key, const KeyEntry &entry) const
+    {
+        uint16_t keySize = key.size();
+        uint16_t valueSize = entry.size();
+
+        header[0] = FLASHKV_RECORD_MAGIC;
+        header[1] = static_cast<uint8_t>(entry.erased ? RecordType::Delete : RecordType::Put);
+        std::memcpy(header + 2, &keySize, sizeof(uint16_t));
+        std::memcpy(header + 4, &valueSize, sizeof(uint16_t));
+
+        // The CRC Covers Everything After The Magic Byte
+        uint32_t crc = crc32(0, header + 1, 5);
+        crc = crc32(crc, reinterpret_cast<const uint8_t *>(key.data()), key.size());
+        crc = crc32(crc, entry.data(), entry.size());
+        std::memcpy(header + 6, &crc, sizeof(uint32_t));
+    }
+
+    void FlashKV::serialiseKeyValuePair(const String &key, const KeyEntry &entry)
+    {
+        uint8_t header[FLASHKV_RECORD_HEADER_SIZE];
+        fillRecordHeader(header, key, entry);
+
+        commitBuffer.insert(commitBuffer.end(), header, header + sizeof(header));
+        commitBuffer.insert(commitBuffer.end(), key.begin(), key.end());
+        commitBuffer.insert(commitBuffer.end(), entry.data(), entry.data() + entry.size());
+    }
+
+    void FlashKV::serialiseAppend(const String &key, const KeyEntry &entry)
+    {
+        const uint8_t *data = entry.value.data() + entry.value.size() - entry.appendedSize;
+        uint16_t keySize = key.size();
+        uint16_t valueSize = FLASHKV_APPEND_HEADER_SIZE + entry.appendedSize;
+        uint8_t header[FLASHKV_RECORD_HEADER_SIZE + FLASHKV_APPEND_HEADER_SIZE] = {FLASHKV_RECORD_MAGIC, static_cast<uint8_t>(RecordType::Append)};
+        std::memcpy(header + 2, &keySize, sizeof(uint16_t));
+        std::memcpy(header + 4, &valueSize, sizeof(uint16_t));
+        std::memcpy(header + FLASHKV_RECORD_HEADER_SIZE, &entry.appendLimit, sizeof(uint16_t));
+        std::memcpy(header + FLASHKV_RECORD_HEADER_SIZE + 2, &entry.location, sizeof(uint32_t));
+
+        // The Appended Bytes Stay In The Value, So The Payload Is Assembled In The Buffer And Checksummed There
+        size_t start = commitBuffer.size();
+        commitBuffer.insert(commitBuffer.end(), header, header + FLASHKV_RECORD_HEADER_SIZE);
+        commitBuffer.insert(commitBuffer.end(), key.begin(), key.end());
+        commitBuffer.insert(commitBuffer.end(), header + FLASHKV_RECORD_HEADER_SIZE, header + sizeof(header));
+        commitBuffer.insert(commitBuffer.end(), data, data + entry.appendedSize);
+
+        uint32_t crc = crc32(0, header + 1, 5);
+        crc = crc32(crc, commitBuffer.data() + start + FLASHKV_RECORD_HEADER_SIZE, keySize + valueSize);
+        std::memcpy(commitBuffer.data() + start + 6, &crc, sizeof(uint32_t));
+    }
+
+    std::optional<FlashKV::Record> FlashKV::deserialiseKeyValuePair(size_t offset, size_t limit)
+    {
+        Record record{RecordStatus::Corrupt, RecordType::Put, offset, 0, KeyValue()};
+
+        uint8_t header[FLASHKV_RECORD_HEADER_SIZE];
+        if (!readFlash(offset, header, sizeof(header)))
+            return std::nullopt;
+
+        if (header[0] == FLASHKV_ERASED_VALUE)
+        {
+            record.status = RecordStatus::Blank;
+            return record;
+        }
+
+        uint16_t keySize, valueSize;
+        uint32_t crc;
+        std::memcpy(&keySize, header + 2, sizeof(uint16_t));
+        std::memcpy(&valueSize, header + 4, sizeof(uint16_t));
+        std::memcpy(&crc, header + 6, sizeof(uint32_t));
+
+        record.type = static_cast<RecordType>(header[1]);
+        record.size = recordSize(keySize, valueSize);
+        if (header[0] != FLASHKV_RECORD_MAGIC || keySize == 0 || offset + record.size > limit ||
+            (record.type != RecordType::Put && record.type != RecordType::Delete && record.type != RecordType::Append) ||
+            (record.type == RecordType::Delete && valueSize != 0) || (record.type == RecordType::Append && valueSize < FLASHKV_APPEND_HEADER_SIZE))
+            return record;
+
+        String &key = record.keyValue.first;
+        key.resize(keySize);
+        if (!readFlash(offset + FLASHKV_RECORD_HEADER_SIZE, reinterpret_cast<uint8_t *>(&key[0]), keySize))
+            return std::nullopt;
+
+        Bytes &value = record.keyValue.second;
+        value.resize(valueSize);
+        if (valueSize > 0 && !readFlash(offset + FLASHKV_RECORD_HEADER_SIZE + keySize, value.data(), valueSize))
+            return std::nullopt;
+
+        uint32_t actual = crc32(0, header + 1, 5);
+        actual = crc32(actual, reinterpret_cast<const uint8_t *>(key.data()), key.size());
+        actual = crc32(actual, value.data(), value.size());
+        if (actual == crc)
+            record.status = RecordStatus::Valid;
+
+        return record;
+    }
+
+#ifndef FLASHKV_NO_LEGACY_FORMAT
+    std::optional<std::pair<size_t, KeyValue>> FlashKV::deserialiseLegacyKeyValuePair(size_t offset)
+    {
+        size_t initialOffset = offset;
+        uint16_t keySize;
+        if (offset + sizeof(uint16_t) > flashSize || !readFlash(offset, reinterpret_cast<uint8_t *>(&keySize), sizeof(uint16_t)))
+            return std::nullopt;
+
+        // Maps End With A Zero Size, Or Erased Flash Memory When They End On A Page Boundary
+        if (keySize == 0 || keySize == UINT16_MAX)
+            return std::make_pair(0, KeyValue());
+
+        offset += sizeof(uint16_t);
+
+        // Sizes Come Straight From Flash Memory, So Never Read Past The End Of The Region
+        if (offset + keySize + sizeof(uint16_t) > flashSize)
+            return std::nullopt;
+
+        String key;
+        key.resize(keySize);
+        if (!readFlash(offset, reinterpret_cast<uint8_t *>(&key[0]), keySize))
+            return std::nullopt;
+
+        offset += keySize;
+
+        uint16_t valueSize;
+        if (!readFlash(offset, reinterpret_cast<uint8_t *>(&valueSize), sizeof(uint16_t)))
+            return std::nullopt;
+
+        offset += sizeof(uint16_t);
+
+        if (offset + valueSize > flashSize)
+            return std::nullopt;
 
-        std::vector<uint8_t> value;
+        Bytes value;
         value.resize(valueSize);
-        if (!flashReadFunction(flashAddress + offset, reinterpret_cast<uint8_t *>(&value[0]), valueSize))
+        if (valueSize > 0 && !readFlash(offset, value.data(), valueSize))
             return std::nullopt;
 
         offset += valueSize;
         return std::make_pair(offset - initialOffset, KeyValue{key, value});
     }
+#endif
 
     // --------------------------------------------------------------------------------------------------------------------- //
 
@@ -0,0 +1,168 @@
+/**
+ * @file AllocationTest.cpp
+ * @brief Checks that FlashKV never allocates in bounded latency mode.
+ *
+ * operator new is replaced to count allocations. After enableBoundedLatency(), random writes, appends, erases,
+ * reads, saves and maintenance run through many rounds of commits, compaction and wear levelling, and none of them
+ * may allocate. Keys that never change fill the first sector, so wear levelling has cold data to move.
+ */
+
+#include "RamFlash.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+
+namespace
+{
+    size_t allocations = 0; // Allocations made while counting.
+    bool counting = false;  // Whether allocations are being counted.
+
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t KEY_COUNT = 20;
+    constexpr size_t COLD_KEYS = 12;
+    constexpr size_t MAX_VALUE_SIZE = 48;
+    constexpr int ROUNDS = 200;
+
+    struct Config
+    {
+        size_t sectorCount; // Sectors in the region.
+        size_t erasedPool;  // Sectors kept erased ahead of time.
+        uint32_t eraseSkew; // Wear levelling gap, 0 for the default.
+    };
+
+    const Config CONFIGS[] = {
+        {3, 0, 0},
+        {4, 1, 0},
+        {4, 0, 2},
+        {6, 2, 2},
+    };
+
+    // Runs Rounds Of Random Changes, Each Committed By maintenance() Or saveMap(), And Returns The Allocations They Made
+    size_t runBounded(const Config &config, uint32_t seed, FlashKV::Statistics &statistics)
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, config.sectorCount);
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * config.sectorCount);
+        kv.setErasedPool(config.erasedPool);
+        if (config.eraseSkew > 0)
+            kv.setWearLevelling(config.eraseSkew);
+
+        std::mt19937 random(seed);
+        FlashKV::String keys[KEY_COUNT];
+        for (size_t i = 0; i < KEY_COUNT; i++)
+            keys[i] = "key" + std::to_string(i);
+
+        if (kv.loadMap() == 0)
+            return SIZE_MAX;
+
+        for (size_t i = 0; i < KEY_COUNT; i++)
+            if (!kv.writeKey(keys[i], FlashKV::Bytes(i < COLD_KEYS ? MAX_VALUE_SIZE : 1 + random() % MAX_VALUE_SIZE, 0x5A)))
+                return SIZE_MAX;
+
+        if (!kv.saveMap() || !kv.enableBoundedLatency(KEY_COUNT, MAX_VALUE_SIZE))
+            return SIZE_MAX;
+
+        uint8_t data[MAX_VALUE_SIZE];
+        allocations = 0;
+        counting = true;
+        for (int round = 0; round < ROUNDS; round++)
+        {
+            for (int step = 0; step < 12; step++)
+            {
+                const FlashKV::String &key = keys[COLD_KEYS + random() % (KEY_COUNT - COLD_KEYS)];
+                size_t size = 1 + random() % MAX_VALUE_SIZE;
+                std::memset(data, static_cast<int>(random()), size);
+                switch (random() % 5)
+                {
+                case 0:
+                    kv.eraseKey(key);
+                    break;
+
+                case 1:
+                    kv.appendToKey(key, data, 1 + size % 8, MAX_VALUE_SIZE);
+                    break;
+
+                case 2:
+                    kv.readKeyInto(key, data, sizeof(data));
+                    break;
+
+                default:
+                    kv.writeKey(key, data, size);
+                    break;
+                }
+            }
+
+            if (random() % 4 == 0)
+            {
+                kv.saveMap();
+                continue;
+            }
+
+            for (int call = 0; call < 1000 && kv.maintenance(0) == 2; call++)
+            {
+            }
+        }
+
+        counting = false;
+        statistics = kv.getStatistics();
+        return allocations;
+    }
+}
+
+void *operator new(size_t size)
+{
+    if (counting)
+        allocations++;
+
+    if (void *pointer = std::malloc(size > 0 ? size : 1))
+        return pointer;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+int main()
+{
+    int failures = 0;
+    for (const Config &config : CONFIGS)
+    {
+        uint32_t compactions = 0, wearLevelMoves = 0;
+        for (uint32_t seed = 0; seed < 20; seed++)
+        {
+            FlashKV::Statistics statistics = {};
+            size_t count = runBounded(config, seed, statistics);
+            if (count != 0)
+            {
+                std::printf("bounded mode allocated: %zu sectors, pool %zu, skew %u, seed %u, %zu allocations\n",
+                            config.sectorCount, config.erasedPool, config.eraseSkew, seed, count);
+                failures++;
+            }
+
+            compactions += statistics.compactions;
+            wearLevelMoves += statistics.wearLevelMoves;
+        }
+
+        // The Rounds Must Have Reached The Paths Being Checked
+        if (compactions == 0 || (config.eraseSkew > 0 && wearLevelMoves == 0))
+        {
+            std::printf("bounded mode never compacted or levelled wear: %zu sectors, pool %zu, skew %u\n",
+                        config.sectorCount, config.erasedPool, config.eraseSkew);
+            failures++;
+        }
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
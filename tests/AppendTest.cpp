@@ -0,0 +1,168 @@
+/**
+ * @file AppendTest.cpp
+ * @brief Tests of appendToKey() and the ring buffers kept by appending with a maximum size.
+ *
+ * Every append is checked against a copy of the value kept alongside FlashKV, through each way a value can be read,
+ * written back and committed: in memory, as append records, rewritten whole by new sectors and compaction, and after a
+ * remount.
+ */
+
+#include "RamFlash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+namespace
+{
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t SECTOR_COUNT = 4;
+    constexpr size_t REGION_SIZE = SECTOR_SIZE * SECTOR_COUNT;
+    constexpr size_t RING_SIZE = 512;
+
+    bool matches(FlashKV::FlashKV &kv, const FlashKV::String &key, const FlashKV::Bytes &expected)
+    {
+        uint8_t buffer[RING_SIZE];
+        auto size = kv.readKeyInto(key, buffer, sizeof(buffer));
+        return kv.readKey(key) == expected && size == expected.size() && std::equal(expected.begin(), expected.end(), buffer);
+    }
+
+    // Appends 2-Byte Event Codes To A Ring Of The Latest 256, Committing Now And Then, And Checks The Ring After Each
+    bool runEventLog()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        std::mt19937 random(7);
+        FlashKV::Bytes expected;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() == 0)
+                return false;
+
+            for (uint16_t code = 0; code < 2000; code++)
+            {
+                const uint8_t event[2] = {static_cast<uint8_t>(code), static_cast<uint8_t>(code >> 8)};
+                if (!kv.appendToKey("events", event, sizeof(event), RING_SIZE))
+                    return false;
+
+                expected.insert(expected.end(), event, event + sizeof(event));
+                if (expected.size() > RING_SIZE)
+                    expected.erase(expected.begin(), expected.begin() + (expected.size() - RING_SIZE));
+
+                if (!matches(kv, "events", expected))
+                    return false;
+
+                if (random() % 16 == 0 && !kv.saveMap())
+                    return false;
+            }
+
+            // Bytes Trimmed Away Are Released As The Ring Turns Over Rather Than Held Forever
+            if (kv.memoryUsage().valueBytes > 4 * RING_SIZE)
+                return false;
+
+            // Values Written Back Whole Compare Against The Ring As Read
+            FlashKV::Bytes replacement(RING_SIZE, 0xA5);
+            if (!kv.compareExchange("events", expected, replacement))
+                return false;
+
+            expected = replacement;
+            const uint8_t tail[3] = {1, 2, 3};
+            if (!kv.appendToKey("events", tail, sizeof(tail), RING_SIZE))
+                return false;
+
+            expected.erase(expected.begin(), expected.begin() + sizeof(tail));
+            expected.insert(expected.end(), tail, tail + sizeof(tail));
+            if (!matches(kv, "events", expected) || !kv.saveMap())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && matches(kv, "events", expected);
+    }
+
+    // Appends Of Random Sizes, Some Larger Than The Limit, Mixed With Writes And Erases Of The Same Keys
+    bool runMixedAppends()
+    {
+        constexpr size_t KEY_COUNT = 3;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        std::mt19937 random(11);
+        FlashKV::Bytes expected[KEY_COUNT];
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() == 0)
+                return false;
+
+            for (int step = 0; step < 5000; step++)
+            {
+                size_t key = random() % KEY_COUNT;
+                FlashKV::String name = "ring" + std::to_string(key);
+                FlashKV::Bytes data(1 + random() % 96, static_cast<uint8_t>(step));
+                size_t limit = 64 + 64 * key;
+                switch (random() % 8)
+                {
+                case 0:
+                    if (!kv.writeKey(name, data))
+                        return false;
+                    expected[key] = data;
+                    break;
+
+                case 1:
+                    if (!expected[key].empty() && !kv.eraseKey(name))
+                        return false;
+                    expected[key].clear();
+                    break;
+
+                default:
+                    if (!kv.appendToKey(name, data, limit))
+                        return false;
+                    expected[key].insert(expected[key].end(), data.begin(), data.end());
+                    if (expected[key].size() > limit)
+                        expected[key].erase(expected[key].begin(), expected[key].end() - limit);
+                    break;
+                }
+
+                if (random() % 8 == 0 && !kv.saveMap())
+                    return false;
+            }
+
+            for (size_t key = 0; key < KEY_COUNT; key++)
+                if (!expected[key].empty() && !matches(kv, "ring" + std::to_string(key), expected[key]))
+                    return false;
+
+            if (!kv.saveMap())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        if (kv.loadMap() != 1)
+            return false;
+
+        for (size_t key = 0; key < KEY_COUNT; key++)
+        {
+            FlashKV::String name = "ring" + std::to_string(key);
+            if (expected[key].empty() ? kv.readKey(name).has_value() : !matches(kv, name, expected[key]))
+                return false;
+        }
+
+        return true;
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    auto check = [&failures](bool passed, const char *name)
+    {
+        if (!passed)
+        {
+            std::printf("%s failed\n", name);
+            failures++;
+        }
+    };
+
+    check(runEventLog(), "ring buffer of event codes");
+    check(runMixedAppends(), "appends mixed with writes and erases");
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file ConcurrencyTest.cpp
+ * @brief Tests of FlashKV calls made from interrupt handlers and other threads while the map is being changed.
+ *
+ * Calls that change the map hold it while they run, and one made while another holds it fails instead of waiting.
+ * Retrying callers must therefore never lose an update, and a call made from inside another must fail cleanly.
+ */
+
+#include "RamFlash.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace
+{
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t SECTOR_COUNT = 4;
+    constexpr size_t REGION_SIZE = SECTOR_SIZE * SECTOR_COUNT;
+    constexpr uint32_t UPDATES = 200000;
+
+    // Runs A Handler Whenever FlashKV Starts Writing, As An Interrupt Taken During A Commit Would
+    class InterruptedFlash final : public FlashKV::FlashDriver
+    {
+    public:
+        explicit InterruptedFlash(FlashKVTests::RamFlash &flash) : flash(flash) {}
+
+        bool read(uint32_t flashAddress, uint8_t *data, size_t count) override
+        {
+            return flash.read(flashAddress, data, count);
+        }
+
+        bool program(uint32_t flashAddress, const uint8_t *data, size_t count) override
+        {
+            return flash.program(flashAddress, data, count);
+        }
+
+        bool erase(uint32_t flashAddress, size_t count) override
+        {
+            return flash.erase(flashAddress, count);
+        }
+
+        bool beginExclusive() override
+        {
+            if (handler)
+                handler();
+
+            return true;
+        }
+
+        std::function<void()> handler; // Called at the start of every group of writes.
+
+    private:
+        FlashKVTests::RamFlash &flash; // Simulated part the calls are passed on to.
+    };
+
+    uint32_t readCounter(FlashKV::FlashKV &kv, const FlashKV::String &key)
+    {
+        uint32_t value = 0;
+        if (auto bytes = kv.readKey(key); bytes && bytes->size() == sizeof(value))
+            std::memcpy(&value, bytes->data(), sizeof(value));
+
+        return value;
+    }
+
+    // Two Threads Add To One Counter, Retrying Whenever The Other Holds The Map
+    bool runFetchAdd()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        if (kv.loadMap() == 0)
+            return false;
+
+        auto worker = [&kv]()
+        {
+            for (uint32_t done = 0; done < UPDATES;)
+                if (kv.fetchAdd<uint32_t>("count", 1))
+                    done++;
+        };
+
+        std::thread first(worker), second(worker);
+        first.join();
+        second.join();
+        return readCounter(kv, "count") == 2 * UPDATES;
+    }
+
+    // Two Threads Read, Increment And Write Back A Counter, Which Only Lands If Nothing Changed It Since The Read
+    bool runVersionedExchange()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        const FlashKV::Bytes zero(sizeof(uint32_t), 0);
+        if (kv.loadMap() == 0 || !kv.writeKey("count", zero) || !kv.enableBoundedLatency(1, sizeof(uint32_t)))
+            return false;
+
+        auto worker = [&kv]()
+        {
+            for (uint32_t done = 0; done < UPDATES;)
+            {
+                uint32_t value, version;
+                uint8_t *bytes = reinterpret_cast<uint8_t *>(&value);
+                if (kv.readKeyInto("count", bytes, sizeof(value), version) != sizeof(value))
+                    continue;
+
+                value++;
+                FlashKV::Bytes desired(bytes, bytes + sizeof(value));
+                if (kv.compareExchange("count", version, desired))
+                    done++;
+            }
+        };
+
+        std::thread first(worker), second(worker);
+        first.join();
+        second.join();
+        return readCounter(kv, "count") == 2 * UPDATES;
+    }
+
+    // One Thread Rewrites Keys While Another Copies Them Out, And Every Copy That Succeeds Must Be A Whole Value
+    bool runConsistentReads()
+    {
+        constexpr size_t KEY_COUNT = 8;
+        constexpr size_t MAX_VALUE_SIZE = 250;
+        constexpr size_t LARGE_SECTOR_COUNT = 16;
+        constexpr uint32_t REWRITES = 10 * UPDATES; // Long Enough For The Reader To Be Preempted Mid-Copy On One Core
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, LARGE_SECTOR_COUNT);
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * LARGE_SECTOR_COUNT);
+        FlashKV::String keys[KEY_COUNT];
+        if (kv.loadMap() == 0)
+            return false;
+
+        for (size_t i = 0; i < KEY_COUNT; i++)
+        {
+            keys[i] = "key" + std::to_string(i);
+            if (!kv.writeKey(keys[i], FlashKV::Bytes(1, 0)))
+                return false;
+        }
+
+        if (!kv.saveMap() || !kv.enableBoundedLatency(KEY_COUNT, MAX_VALUE_SIZE))
+            return false;
+
+        // Each Value Is Filled With One Byte, Which Also Gives Its Size
+        std::atomic<bool> stop{false}, torn{false};
+        std::atomic<uint32_t> copies{0};
+        auto reader = [&]()
+        {
+            uint8_t buffer[MAX_VALUE_SIZE];
+            while (!stop.load())
+                for (const auto &key : keys)
+                {
+                    auto size = kv.readKeyInto(key, buffer, sizeof(buffer));
+                    if (!size)
+                        continue;
+
+                    bool whole = *size == buffer[0] % MAX_VALUE_SIZE + 1u;
+                    for (size_t i = 1; i < *size; i++)
+                        whole = whole && buffer[i] == buffer[0];
+
+                    torn.store(torn.load() || !whole);
+                    copies.fetch_add(1);
+                }
+        };
+
+        std::thread reading(reader);
+        bool written = true;
+        for (uint32_t step = 0; step < REWRITES && written; step++)
+        {
+            const FlashKV::String &key = keys[step % KEY_COUNT];
+            uint8_t fill = static_cast<uint8_t>(step);
+            if (step % 97 == 0)
+                kv.eraseKey(key);
+            else
+                written = kv.writeKey(key, FlashKV::Bytes(fill % MAX_VALUE_SIZE + 1, fill));
+
+            if (step % 50 == 0)
+                kv.maintenance(0);
+        }
+
+        stop.store(true);
+        reading.join();
+        return written && !torn.load() && copies.load() > 0 && kv.saveMap();
+    }
+
+    // Writes Made From A Handler That Interrupts A Save Fail, And The Save Still Commits Everything It Started With
+    bool runInterruptedSave()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        InterruptedFlash driver(flash);
+        const FlashKV::Bytes saved = {1}, interrupting = {2};
+        size_t attempts = 0, accepted = 0;
+        {
+            FlashKV::FlashKV kv(driver, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() == 0 || !kv.writeKey("k", saved))
+                return false;
+
+            driver.handler = [&]()
+            {
+                attempts++;
+                accepted += kv.writeKey("k", interrupting) + kv.eraseKey("k") + kv.appendToKey("k", interrupting);
+                accepted += kv.compareExchange("k", saved, interrupting) + kv.fetchAdd<uint8_t>("k", 1).has_value();
+                accepted += kv.saveMap() + (kv.maintenance(0) != 2);
+            };
+
+            if (!kv.saveMap())
+                return false;
+
+            driver.handler = nullptr;
+            if (attempts == 0 || accepted != 0 || kv.readKey("k") != saved)
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && kv.readKey("k") == saved;
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    auto check = [&failures](bool passed, const char *name)
+    {
+        if (!passed)
+        {
+            std::printf("%s failed\n", name);
+            failures++;
+        }
+    };
+
+    check(runFetchAdd(), "fetchAdd() from two threads");
+    check(runVersionedExchange(), "versioned compareExchange() from two threads");
+    check(runConsistentReads(), "readKeyInto() during writes from another thread");
+    check(runInterruptedSave(), "writes interrupting saveMap()");
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file EmbeddedTest.cpp
+ * @brief Tests of a FLASHKV_EMBEDDED build, compiled without exceptions or RTTI.
+ *
+ * Every container allocates from the buffer given to setStaticBuffer(), so operator new is replaced to check that the
+ * heap is never touched. The buffer is deliberately small: writes, appends and erases must start failing cleanly once
+ * it runs out instead of aborting, and everything they accepted must still commit and load back.
+ */
+
+#include "RamFlash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+
+namespace
+{
+    size_t heapAllocations = 0; // Heap allocations made while counting.
+    bool counting = false;      // Whether heap allocations are being counted.
+
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t SECTOR_COUNT = 16;
+    constexpr size_t REGION_SIZE = SECTOR_SIZE * SECTOR_COUNT;
+    constexpr size_t COMMIT_HEADROOM = 4096;
+    constexpr size_t KEY_COUNT = 300;
+    constexpr size_t MAX_VALUE_SIZE = 64;
+
+    alignas(16) uint8_t arena[12 * 1024]; // Static buffer every container allocates from.
+
+    // Values Expected For Each Key, Held In Fixed Arrays So The Model Itself Never Allocates
+    struct Model
+    {
+        uint8_t values[KEY_COUNT][MAX_VALUE_SIZE]; // Expected value of each key.
+        size_t sizes[KEY_COUNT];                   // Size of each expected value.
+        bool present[KEY_COUNT];                   // Whether each key is expected to exist.
+    };
+
+    Model model;
+
+    // Keys Short Enough To Be Held Inside The String, So Building One Never Needs The Buffer
+    FlashKV::String keyFor(size_t index)
+    {
+        char key[8];
+        std::snprintf(key, sizeof(key), "k%03u", static_cast<unsigned>(index));
+        return FlashKV::String(key);
+    }
+
+    bool matches(FlashKV::FlashKV &kv)
+    {
+        for (size_t index = 0; index < KEY_COUNT; index++)
+        {
+            uint8_t value[MAX_VALUE_SIZE];
+            auto size = kv.readKeyInto(keyFor(index), value, sizeof(value));
+            if (size.has_value() != model.present[index])
+                return false;
+
+            if (size && (*size != model.sizes[index] || std::memcmp(value, model.values[index], *size) != 0))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Writes, Appends And Erases Until The Buffer Runs Out, Then Commits And Reloads What Was Accepted
+    bool runExhaustion()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        std::mt19937 random(1);
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() != 2)
+                return false;
+
+            // Space Held Back Here Is Released For The Commit Buffer Once The Changes Have Been Made
+            void *headroom = FlashKV::allocateStatic(COMMIT_HEADROOM);
+            counting = true;
+            size_t rejected = 0;
+            for (uint32_t step = 0; step < 2000; step++)
+            {
+                size_t index = random() % KEY_COUNT;
+                FlashKV::String key = keyFor(index);
+                uint8_t data[MAX_VALUE_SIZE];
+                size_t size = 1 + random() % 40;
+                std::memset(data, 'a' + step % 26, size);
+                switch (random() % 4)
+                {
+                case 0:
+                    if (kv.eraseKey(key))
+                        model.present[index] = false;
+                    break;
+
+                case 1:
+                    if (!kv.appendToKey(key, data, size, MAX_VALUE_SIZE))
+                        rejected++;
+                    else if (!model.present[index])
+                    {
+                        model.present[index] = true;
+                        model.sizes[index] = size;
+                        std::memcpy(model.values[index], data, size);
+                    }
+                    else
+                    {
+                        // Only The Newest MAX_VALUE_SIZE Bytes Are Kept
+                        size_t total = std::min(model.sizes[index] + size, MAX_VALUE_SIZE);
+                        size_t kept = total - size;
+                        std::memmove(model.values[index], model.values[index] + model.sizes[index] - kept, kept);
+                        std::memcpy(model.values[index] + kept, data, size);
+                        model.sizes[index] = total;
+                    }
+                    break;
+
+                default:
+                    if (!kv.writeKey(key, data, size))
+                        rejected++;
+                    else
+                    {
+                        model.present[index] = true;
+                        model.sizes[index] = size;
+                        std::memcpy(model.values[index], data, size);
+                    }
+                    break;
+                }
+            }
+
+            // The Buffer Must Actually Have Run Out, And Nothing Rejected May Have Changed The Map
+            if (rejected == 0 || !matches(kv))
+                return false;
+
+            FlashKV::deallocateStatic(headroom);
+            if (!kv.saveMap())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && matches(kv);
+    }
+}
+
+void *operator new(size_t size)
+{
+    if (counting)
+        heapAllocations++;
+
+    if (void *pointer = std::malloc(size > 0 ? size : 1))
+        return pointer;
+
+    std::abort();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+int main()
+{
+    FlashKV::setStaticBuffer(arena, sizeof(arena));
+
+    bool passed = runExhaustion();
+    counting = false;
+
+    int failures = 0;
+    if (!passed)
+    {
+        std::printf("static buffer exhaustion failed\n");
+        failures++;
+    }
+
+    if (heapAllocations != 0)
+    {
+        std::printf("embedded build allocated from the heap %zu times\n", heapAllocations);
+        failures++;
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
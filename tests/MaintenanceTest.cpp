@@ -0,0 +1,431 @@
+/**
+ * @file MaintenanceTest.cpp
+ * @brief Tests of the background work scheduled by maintenance() and of the limits placed on it.
+ *
+ * A simulated clock stands in for the system timer, so windows and rate limits are crossed by advancing it rather
+ * than by waiting. Every test ends by checking the map against the values last written.
+ */
+
+#include "RamFlash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace
+{
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t SECTOR_COUNT = 4;
+    constexpr size_t REGION_SIZE = SECTOR_SIZE * SECTOR_COUNT;
+    constexpr uint64_t WINDOW_MICROS = 1000000;
+    constexpr uint32_t WINDOW_ERASES = 2;
+
+    uint64_t now = 0; // Simulated time in microseconds.
+
+    FlashKV::Bytes valueFor(size_t key, int round)
+    {
+        return FlashKV::Bytes(200, static_cast<uint8_t>(key * 31 + round));
+    }
+
+    bool matches(FlashKV::FlashKV &kv, size_t keyCount, int round)
+    {
+        for (size_t key = 0; key < keyCount; key++)
+            if (kv.readKey("key" + std::to_string(key)) != valueFor(key, round))
+                return false;
+
+        return true;
+    }
+
+    // Erases Run In The Background For A Number Of busy() Polls, And Reads Fail While One Runs Unless It Is Suspended
+    class AsyncFlash final : public FlashKV::FlashDriver
+    {
+    public:
+        explicit AsyncFlash(FlashKVTests::RamFlash &flash) : flash(flash) {}
+
+        bool read(uint32_t flashAddress, uint8_t *data, size_t count) override
+        {
+            if (erasing() && !suspended)
+            {
+                blockedAccesses++;
+                return false;
+            }
+
+            return flash.read(flashAddress, data, count);
+        }
+
+        bool program(uint32_t flashAddress, const uint8_t *data, size_t count) override
+        {
+            if (erasing())
+            {
+                blockedAccesses++;
+                return false;
+            }
+
+            return flash.program(flashAddress, data, count);
+        }
+
+        bool erase(uint32_t flashAddress, size_t count) override
+        {
+            return !erasing() && flash.erase(flashAddress, count);
+        }
+
+        FlashKV::FlashCapabilities capabilities() const override
+        {
+            FlashKV::FlashCapabilities capabilities;
+            capabilities.asyncErase = true;
+            return capabilities;
+        }
+
+        bool eraseStart(uint32_t flashAddress, size_t count) override
+        {
+            if (erasing())
+                return false;
+
+            eraseAddress = flashAddress;
+            eraseCount = count;
+            pollsLeft = ERASE_POLLS;
+            return true;
+        }
+
+        bool busy() override
+        {
+            if (erasing() && !suspended && --pollsLeft == 0)
+                flash.erase(eraseAddress, eraseCount);
+
+            return erasing();
+        }
+
+        bool suspend() override
+        {
+            if (!erasing() || suspended)
+                return false;
+
+            suspended = true;
+            suspends++;
+            return true;
+        }
+
+        bool resume() override
+        {
+            if (!suspended)
+                return false;
+
+            suspended = false;
+            return true;
+        }
+
+        bool erasing() const { return pollsLeft > 0; }
+
+        static constexpr int ERASE_POLLS = 3;
+        int pollsLeft = 0;          // Polls until the running erase finishes, or 0 if none is running.
+        bool suspended = false;     // Whether the running erase is suspended.
+        size_t suspends = 0;        // Times an erase has been suspended.
+        size_t blockedAccesses = 0; // Reads and programs attempted while an erase was running.
+
+    private:
+        FlashKVTests::RamFlash &flash; // Simulated part the calls are passed on to.
+        uint32_t eraseAddress = 0;     // Start of the running erase.
+        size_t eraseCount = 0;         // Size of the running erase.
+    };
+
+    // Once A Window's Erases Are Used Up, Commits Are Deferred And maintenance() Leaves Compacted Sectors And The
+    // Erased Pool Unerased Until The Next Window
+    bool runWearBudget()
+    {
+        constexpr size_t KEY_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        now = 0;
+        int round = 0;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            kv.setClockFunction([]() { return now; });
+            kv.setErasedPool(1);
+            if (kv.loadMap() == 0 || !kv.setWearBudget(WINDOW_ERASES, 0, WINDOW_MICROS))
+                return false;
+
+            // Save Until The Budget Defers A Commit
+            bool deferred = false;
+            for (; round < 50 && !deferred; round++)
+            {
+                for (size_t key = 0; key < KEY_COUNT; key++)
+                    kv.writeKey("key" + std::to_string(key), valueFor(key, round));
+
+                deferred = !kv.saveMap();
+                if (deferred && !kv.getStatistics().throttled)
+                    return false;
+            }
+
+            if (!deferred)
+                return false;
+
+            // No More Than The Budget Is Erased While The First Window Lasts
+            round--;
+            for (int call = 0; call < 50; call++)
+                if (kv.maintenance(WINDOW_MICROS) != 2)
+                    return false;
+
+            uint32_t erases = kv.getStatistics().sectorErases;
+            if (erases > WINDOW_ERASES)
+                return false;
+
+            // Later Windows Let The Deferred Commit And The Erases Through
+            uint8_t result = 2;
+            for (int call = 0; call < 200 && result == 2; call++)
+            {
+                now += WINDOW_MICROS / 4;
+                result = kv.maintenance(WINDOW_MICROS);
+            }
+
+            if (result != 1 || kv.getStatistics().throttled || kv.getStatistics().sectorErases == erases)
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && matches(kv, KEY_COUNT, round);
+    }
+
+    // Reads Made While maintenance() Has An Erase Running Suspend It, And Suspending Maintenance Holds Back The Erase
+    bool runEraseSuspend()
+    {
+        constexpr size_t KEY_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        AsyncFlash driver(flash);
+        int round = 0;
+        size_t erases = 0;
+        {
+            FlashKV::FlashKV kv(driver, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            kv.setErasedPool(1);
+            if (kv.loadMap() == 0)
+                return false;
+
+            for (; round < 40; round++)
+            {
+                for (size_t key = 0; key < KEY_COUNT; key++)
+                    kv.writeKey("key" + std::to_string(key), valueFor(key, round));
+
+                uint8_t result = 2;
+                for (int call = 0; call < 1000 && result == 2; call++)
+                {
+                    result = kv.maintenance(0);
+                    if (!driver.erasing() || driver.pollsLeft != AsyncFlash::ERASE_POLLS)
+                        continue;
+
+                    // A Priority Read Sees Flash Memory Through The Suspended Erase, Which Then Carries On
+                    erases++;
+                    uint8_t page[PAGE_SIZE];
+                    size_t suspends = driver.suspends;
+                    if (!kv.priorityRead(0, page, sizeof(page)) || std::memcmp(page, flash.contents().data(), sizeof(page)) != 0 ||
+                        driver.suspends != suspends + 1 || driver.suspended || !driver.erasing())
+                        return false;
+
+                    // Nothing Moves While Maintenance Is Suspended
+                    if (!kv.suspendMaintenance() || !driver.suspended || kv.maintenance(0) != 2 || driver.pollsLeft != AsyncFlash::ERASE_POLLS ||
+                        !kv.resumeMaintenance() || driver.suspended)
+                        return false;
+                }
+
+                if (result != 1 || kv.readKey("key0") != valueFor(0, round))
+                    return false;
+            }
+
+            if (erases == 0 || driver.blockedAccesses != 0)
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && matches(kv, KEY_COUNT, round - 1);
+    }
+
+    // A Rate Limited Class Never Gets Ahead Of Its Allowance, However Often maintenance() Is Called
+    bool runRateLimit()
+    {
+        constexpr size_t KEY_COUNT = 12;
+        constexpr size_t LARGE_SECTOR_COUNT = 8;
+        constexpr size_t BYTES_PER_SECOND = 256;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, LARGE_SECTOR_COUNT);
+        now = 0;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * LARGE_SECTOR_COUNT);
+            kv.setClockFunction([]() { return now; });
+            if (kv.loadMap() == 0)
+                return false;
+
+            kv.setRateLimit(FlashKV::IoClass::Commit, BYTES_PER_SECOND);
+            for (size_t key = 0; key < KEY_COUNT; key++)
+                kv.writeKey("key" + std::to_string(key), valueFor(key, 0));
+
+            // A Burst Of One Sector Is Allowed Up Front, Then The Rate Itself, Overshooting By At Most One Program
+            uint8_t result = 2;
+            uint64_t start = now;
+            for (int call = 0; call < 10000 && result == 2; call++)
+            {
+                for (int repeat = 0; repeat < 4 && result == 2; repeat++)
+                    result = kv.maintenance(WINDOW_MICROS);
+
+                uint64_t allowed = SECTOR_SIZE + (now - start) * BYTES_PER_SECOND / 1000000 + PAGE_SIZE;
+                if (kv.getStatistics().bytesProgrammed > allowed)
+                    return false;
+
+                now += WINDOW_MICROS / 8;
+            }
+
+            // The Commit Is Larger Than The Burst, So It Must Have Been Spread Out
+            if (result != 1 || now - start < WINDOW_MICROS)
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * LARGE_SECTOR_COUNT);
+        return kv.loadMap() == 1 && matches(kv, KEY_COUNT, 0);
+    }
+
+    // Commits Go Ahead Of Compaction, And Compaction That Has Used Up Its Allowance Never Holds A Commit Back
+    bool runScheduling()
+    {
+        constexpr size_t KEY_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        now = 0;
+        int round = 0;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            kv.setClockFunction([]() { return now; });
+            kv.setErasedPool(1);
+            if (kv.loadMap() == 0)
+                return false;
+
+            // The Clock Never Moves, So Compaction Gets Its First Burst And Nothing More
+            kv.setRateLimit(FlashKV::IoClass::Compaction, 1);
+            bool compactionWaiting = false;
+            for (; round < 30; round++)
+            {
+                for (size_t key = 0; key < KEY_COUNT; key++)
+                    kv.writeKey("key" + std::to_string(key), valueFor(key, round));
+
+                uint32_t commits = kv.getStatistics().commits;
+                for (int call = 0; call < 1000 && kv.getStatistics().commits == commits; call++)
+                    compactionWaiting = kv.maintenance(WINDOW_MICROS) == 2;
+
+                if (kv.getStatistics().commits == commits)
+                    return false;
+            }
+
+            // Lifting The Limit Lets The Waiting Compaction Finish
+            kv.setRateLimit(FlashKV::IoClass::Compaction, 0);
+            uint8_t result = 2;
+            for (int call = 0; call < 1000 && result == 2; call++)
+                result = kv.maintenance(WINDOW_MICROS);
+
+            if (!compactionWaiting || result != 1 || kv.getStatistics().commitErases == 0)
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        return kv.loadMap() == 1 && matches(kv, KEY_COUNT, round - 1);
+    }
+
+    // Rewrites Hot Keys Next To Cold Ones That Never Change, And Returns The Gap Between The Least And Most Worn Sectors
+    uint32_t runHotAndCold(uint32_t maxEraseSkew, uint32_t &wearLevelMoves)
+    {
+        constexpr size_t LARGE_SECTOR_COUNT = 8;
+        constexpr size_t COLD_KEYS = 12;
+        const FlashKV::Bytes cold(60, 0xC0);
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, LARGE_SECTOR_COUNT);
+        std::mt19937 random(3);
+        uint32_t gap = UINT32_MAX;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * LARGE_SECTOR_COUNT);
+            kv.setWearLevelling(maxEraseSkew);
+            if (kv.loadMap() == 0)
+                return UINT32_MAX;
+
+            for (size_t key = 0; key < COLD_KEYS; key++)
+                kv.writeKey("cold" + std::to_string(key), cold);
+
+            for (int step = 0; step < 6000; step++)
+            {
+                kv.writeKey("hot" + std::to_string(random() % 4), FlashKV::Bytes(1 + random() % 50, static_cast<uint8_t>(step)));
+                if (step % 3 == 0 && !kv.saveMap())
+                    return UINT32_MAX;
+            }
+
+            if (!kv.saveMap())
+                return UINT32_MAX;
+
+            uint32_t least = UINT32_MAX, most = 0;
+            for (const auto &usage : kv.getSectorUsage())
+            {
+                least = std::min(least, usage.eraseCount);
+                most = std::max(most, usage.eraseCount);
+            }
+
+            gap = most - least;
+            wearLevelMoves = kv.getStatistics().wearLevelMoves;
+        }
+
+        // Cold Data Moved Around The Region Must Still Load
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * LARGE_SECTOR_COUNT);
+        if (kv.loadMap() != 1)
+            return UINT32_MAX;
+
+        for (size_t key = 0; key < COLD_KEYS; key++)
+            if (kv.readKey("cold" + std::to_string(key)) != cold)
+                return UINT32_MAX;
+
+        return gap;
+    }
+
+    // Cold Sectors Fall Behind Without Static Wear Levelling, And Are Kept Within The Allowed Gap With It
+    bool runWearLevelling()
+    {
+        constexpr uint32_t MAX_ERASE_SKEW = 4;
+        uint32_t movesWithout = 0, movesWith = 0;
+        uint32_t gapWithout = runHotAndCold(0, movesWithout);
+        uint32_t gapWith = runHotAndCold(MAX_ERASE_SKEW, movesWith);
+        return gapWithout != UINT32_MAX && gapWithout > 2 * MAX_ERASE_SKEW && movesWithout == 0 && gapWith <= MAX_ERASE_SKEW + 1 && movesWith > 0;
+    }
+
+    // Without A Clock The Budget Is Refused Rather Than Silently Ignored, And Saves Are Never Deferred
+    bool runWearBudgetWithoutClock()
+    {
+        constexpr size_t KEY_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        if (kv.loadMap() == 0 || kv.setWearBudget(1, 0, WINDOW_MICROS) || !kv.setWearBudget(0, 0, 0))
+            return false;
+
+        for (int round = 0; round < 20; round++)
+        {
+            for (size_t key = 0; key < KEY_COUNT; key++)
+                kv.writeKey("key" + std::to_string(key), valueFor(key, round));
+
+            if (!kv.saveMap())
+                return false;
+        }
+
+        return kv.getStatistics().throttledCommits == 0 && kv.getStatistics().sectorErases > 1 && matches(kv, KEY_COUNT, 19);
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    auto check = [&failures](bool passed, const char *name)
+    {
+        if (!passed)
+        {
+            std::printf("%s failed\n", name);
+            failures++;
+        }
+    };
+
+    check(runWearBudget(), "wear budget");
+    check(runWearBudgetWithoutClock(), "wear budget without a clock");
+    check(runEraseSuspend(), "erase suspended by priorityRead() and suspendMaintenance()");
+    check(runRateLimit(), "commit rate limit");
+    check(runScheduling(), "commits ahead of rate limited compaction");
+    check(runWearLevelling(), "static wear levelling");
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,365 @@
+/**
+ * @file PowerLossTest.cpp
+ * @brief Randomised differential test of FlashKV against a std::map, with power cuts and remounts.
+ *
+ * Random sequences of writes, appends, erases, saves and maintenance run against FlashKV and a std::map. Power is
+ * cut after every possible flash operation in turn, and after each cut the map is remounted and checked against
+ * the rules in the README: every key reads back as its value from the last successful commit or from one started
+ * since, and the map keeps accepting commits. Runs without cuts remount after every round and must match exactly.
+ */
+
+#include "RamFlash.h"
+
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using Model = std::map<FlashKV::String, FlashKV::Bytes>;
+
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t KEY_COUNT = 12;
+    constexpr size_t APPEND_LIMIT = 80;
+    constexpr long MAX_CUT = 250;
+
+    struct Config
+    {
+        size_t sectorCount;  // Sectors in the region.
+        size_t erasedPool;   // Sectors kept erased ahead of time.
+        uint32_t eraseSkew;  // Wear levelling gap, 0 for the default.
+    };
+
+    const Config CONFIGS[] = {
+        {2, 0, 0},
+        {3, 0, 0},
+        {4, 1, 0},
+        {4, 1, 2},
+        {5, 2, 2},
+        {6, 0, 3},
+    };
+
+    void configure(FlashKV::FlashKV &kv, const Config &config)
+    {
+        kv.setErasedPool(config.erasedPool);
+        if (config.eraseSkew > 0)
+            kv.setWearLevelling(config.eraseSkew);
+    }
+
+    std::optional<FlashKV::Bytes> lookup(const Model &model, const FlashKV::String &key)
+    {
+        auto it = model.find(key);
+        if (it == model.end())
+            return std::nullopt;
+
+        return it->second;
+    }
+
+    // Applies One Random Change To FlashKV, And To The Model When FlashKV Accepts It
+    void randomChange(FlashKV::FlashKV &kv, Model &model, std::mt19937 &random)
+    {
+        FlashKV::String key = "k" + std::to_string(random() % KEY_COUNT);
+        FlashKV::Bytes value(random() % 40, static_cast<uint8_t>(random()));
+        switch (random() % 6)
+        {
+        case 0:
+            kv.eraseKey(key);
+            model.erase(key);
+            break;
+
+        case 1:
+        case 2:
+        {
+            if (value.empty() || !kv.appendToKey(key, value, APPEND_LIMIT))
+                break;
+
+            FlashKV::Bytes &current = model[key];
+            current.insert(current.end(), value.begin(), value.end());
+            if (current.size() > APPEND_LIMIT)
+                current.erase(current.begin(), current.end() - APPEND_LIMIT);
+            break;
+        }
+
+        default:
+            if (kv.writeKey(key, value))
+                model[key] = value;
+            break;
+        }
+    }
+
+    bool matchesExactly(FlashKV::FlashKV &kv, const Model &model)
+    {
+        if (kv.getAllKeys().size() != model.size())
+            return false;
+
+        for (const auto &[key, value] : model)
+            if (kv.readKey(key) != value)
+                return false;
+
+        return true;
+    }
+
+    // Every Key Must Hold Its Value From One Of The Commits Since The Last Confirmed One, Where Missing Is A Value
+    bool matchesCommit(FlashKV::FlashKV &kv, const std::vector<Model> &commits)
+    {
+        for (size_t i = 0; i < KEY_COUNT; i++)
+        {
+            FlashKV::String key = "k" + std::to_string(i);
+            auto value = kv.readKey(key);
+            bool found = false;
+            for (const Model &commit : commits)
+                found = found || value == lookup(commit, key);
+
+            if (!found)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool runCut(const Config &config, long cut)
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, config.sectorCount);
+        std::mt19937 random(static_cast<uint32_t>(cut * 7919 + config.sectorCount));
+        Model current;
+
+        // The Last Confirmed Commit, Followed By Every Commit Attempted Since, Any Of Which May Have Reached Flash
+        std::vector<Model> commits(1);
+
+        // Build Up Some History, Then Cut Power Part Way Through The Workload
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * config.sectorCount);
+            configure(kv, config);
+            if (kv.loadMap() == 0)
+                return false;
+
+            flash.cutPowerAfter(cut, static_cast<uint32_t>(cut));
+            for (int step = 0; step < 400 && !flash.lostPower(); step++)
+            {
+                randomChange(kv, current, random);
+                bool attempted = false, confirmed = false;
+                if (random() % 4 == 0)
+                    attempted = true, confirmed = kv.saveMap();
+                else if (random() % 6 == 0)
+                    attempted = true, confirmed = kv.maintenance(0) == 1;
+
+                if (confirmed)
+                    commits.assign(1, current);
+                else if (attempted)
+                    commits.push_back(current);
+            }
+
+            // Without A Cut There Is Nothing To Check Beyond The Runs Without Cuts
+            if (!flash.lostPower())
+                return true;
+        }
+
+        commits.push_back(current);
+        flash.restorePower();
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * config.sectorCount);
+        configure(kv, config);
+        if (kv.loadMap() == 0 || !matchesCommit(kv, commits))
+            return false;
+
+        // The Map Keeps Accepting Commits And Reads Back Exactly After Another Remount
+        Model recovered;
+        for (const auto &key : kv.getAllKeys())
+            recovered[key] = *kv.readKey(key);
+
+        for (int step = 0; step < 40; step++)
+            randomChange(kv, recovered, random);
+
+        if (!kv.saveMap())
+            return false;
+
+        FlashKV::FlashKV remounted(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * config.sectorCount);
+        configure(remounted, config);
+        return remounted.loadMap() != 0 && matchesExactly(remounted, recovered);
+    }
+
+    bool runRemounts(const Config &config, uint32_t seed)
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, config.sectorCount);
+        std::mt19937 random(seed);
+        Model model;
+
+        for (int round = 0; round < 40; round++)
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * config.sectorCount);
+            configure(kv, config);
+            if (kv.loadMap() == 0 || !matchesExactly(kv, model))
+                return false;
+
+            for (int step = 0; step < 60; step++)
+            {
+                randomChange(kv, model, random);
+                if (random() % 5 == 0 && !kv.saveMap())
+                    return false;
+
+                if (random() % 7 == 0 && kv.maintenance(0) == 0)
+                    return false;
+            }
+
+            if (!kv.saveMap())
+                return false;
+        }
+
+        return true;
+    }
+
+    // A Commit Made After Replaying An Emergency Flush Must Replay After The Journal On The Next Mount
+    bool runJournalReplay()
+    {
+        constexpr size_t SECTOR_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        const FlashKV::Bytes flushed = {1}, committed = {2};
+
+        // The Flush Covers A Commit Whose New Sector Header Never Reaches Flash
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            kv.setEmergencyJournal(1);
+            if (kv.loadMap() == 0 || !kv.suspendMaintenance() || !kv.writeKey("k", flushed) || kv.maintenance(0) == 0)
+                return false;
+
+            if (!kv.emergencyFlush())
+                return false;
+        }
+
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            kv.setEmergencyJournal(1);
+            kv.setErasedPool(1);
+            if (kv.loadMap() == 0 || kv.readKey("k") != flushed || !kv.writeKey("k", committed) || !kv.saveMap())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+        kv.setEmergencyJournal(1);
+        kv.setErasedPool(1);
+        return kv.loadMap() != 0 && kv.readKey("k") == committed;
+    }
+
+    // A Flush With Nothing Pending Leaves The Journal Erased, And A Map Held Only In The Journal Still Mounts As One
+    bool runJournalOnly()
+    {
+        constexpr size_t SECTOR_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        const FlashKV::Bytes flushed = {1};
+
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            kv.setEmergencyJournal(1);
+            if (kv.loadMap() != 2 || !kv.emergencyFlush())
+                return false;
+
+            for (uint8_t byte : flash.contents())
+                if (byte != 0xFF)
+                    return false;
+
+            if (!kv.writeKey("k", flushed) || !kv.emergencyFlush())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+        kv.setEmergencyJournal(1);
+        return kv.loadMap() == 1 && kv.readKey("k") == flushed;
+    }
+
+    // A Warm Reboot Mounts From The Retained Copy, Unless A Commit Made Without It Has Moved Flash Memory Past It
+    bool runRetainedCopy()
+    {
+        constexpr size_t SECTOR_COUNT = 4;
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        std::vector<uint8_t> retained(2 * SECTOR_SIZE);
+
+        // The Copied Value Fills Its Sector Exactly, So The Active Sector Has No Next Program Unit To Check
+        const FlashKV::Bytes copied(SECTOR_SIZE - FlashKV::FLASHKV_SECTOR_HEADER_SIZE - FlashKV::FLASHKV_RECORD_HEADER_SIZE - 1, 1);
+        const FlashKV::Bytes committed = {2};
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            kv.setRetainedMemory(retained.data(), retained.size());
+            if (kv.loadMap() != 2 || !kv.writeKey("k", copied) || !kv.saveMap() || kv.maintenance(0) != 1)
+                return false;
+        }
+
+        // Damaging The Record Shows The Value Came From The Copy Rather Than From Flash Memory
+        size_t sector = 0;
+        while (sector < SECTOR_COUNT && flash.contents()[sector * SECTOR_SIZE] != 'F')
+            sector++;
+
+        if (sector == SECTOR_COUNT)
+            return false;
+
+        uint8_t &last = flash.contents()[(sector + 1) * SECTOR_SIZE - 1];
+        last ^= 0xFF;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            kv.setRetainedMemory(retained.data(), retained.size());
+            if (kv.loadMap() != 1 || kv.readKey("k") != copied)
+                return false;
+        }
+
+        last ^= 0xFF;
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+            if (kv.loadMap() != 1 || !kv.writeKey("k", committed) || !kv.saveMap())
+                return false;
+        }
+
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, SECTOR_SIZE * SECTOR_COUNT);
+        kv.setRetainedMemory(retained.data(), retained.size());
+        return kv.loadMap() == 1 && kv.readKey("k") == committed;
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    for (const Config &config : CONFIGS)
+    {
+        for (long cut = 0; cut <= MAX_CUT; cut++)
+        {
+            if (!runCut(config, cut))
+            {
+                std::printf("power cut failed: %zu sectors, pool %zu, skew %u, cut after %ld operations\n",
+                            config.sectorCount, config.erasedPool, config.eraseSkew, cut);
+                failures++;
+            }
+        }
+
+        for (uint32_t seed = 0; seed < 200; seed++)
+        {
+            if (!runRemounts(config, seed))
+            {
+                std::printf("remount failed: %zu sectors, pool %zu, skew %u, seed %u\n",
+                            config.sectorCount, config.erasedPool, config.eraseSkew, seed);
+                failures++;
+            }
+        }
+    }
+
+    if (!runJournalReplay())
+    {
+        std::printf("journal replay failed\n");
+        failures++;
+    }
+
+    if (!runJournalOnly())
+    {
+        std::printf("journal only map failed\n");
+        failures++;
+    }
+
+    if (!runRetainedCopy())
+    {
+        std::printf("retained copy failed\n");
+        failures++;
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file QueueTest.cpp
+ * @brief Tests of the persistent queues kept by pushToQueue() and popFromQueue().
+ *
+ * Entries are numbered as they are pushed, so a queue read back after a remount or a power cut can be checked for
+ * order as well as content. Remounts must give back exactly the queue that was saved. After a power cut, entries popped
+ * since the last save may come back, but what remains must still be a run of consecutive entries that starts and ends
+ * between the queue as last saved and the queue when power was cut.
+ */
+
+#include "RamFlash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <random>
+
+namespace
+{
+    constexpr size_t PAGE_SIZE = 64;
+    constexpr size_t SECTOR_SIZE = 1024;
+    constexpr size_t SECTOR_COUNT = 4;
+    constexpr size_t REGION_SIZE = SECTOR_SIZE * SECTOR_COUNT;
+    constexpr size_t MAX_LENGTH = 32;
+    constexpr long MAX_CUT = 120;
+
+    // Entries Start With Their Number And Are Padded With Its Low Byte To A Size That Varies With It
+    FlashKV::Bytes makeEntry(uint32_t number)
+    {
+        FlashKV::Bytes entry(sizeof(uint32_t) + number % 40, static_cast<uint8_t>(number));
+        std::memcpy(entry.data(), &number, sizeof(uint32_t));
+        return entry;
+    }
+
+    std::optional<uint32_t> entryNumber(const std::optional<FlashKV::Bytes> &entry)
+    {
+        if (!entry || entry->size() < sizeof(uint32_t))
+            return std::nullopt;
+
+        uint32_t number;
+        std::memcpy(&number, entry->data(), sizeof(uint32_t));
+        if (*entry != makeEntry(number))
+            return std::nullopt;
+
+        return number;
+    }
+
+    // Pushes And Pops At Random, Remounting After Every Save, With An Ordinary Key Of The Same Name Alongside
+    bool runRemounts()
+    {
+        FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+        std::mt19937 random(3);
+        std::deque<uint32_t> expected;
+        uint32_t pushed = 0;
+        for (int round = 0; round < 40; round++)
+        {
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() != (round == 0 ? 2 : 1))
+                return false;
+
+            if (round == 0 && !kv.writeKey("outbox", FlashKV::Bytes(3, 0x5A)))
+                return false;
+
+            // The Queue's Own Keys Stay Hidden
+            auto keys = kv.getAllKeys();
+            if (keys.size() != 1 || keys[0] != "outbox" || kv.readKey("outbox") != FlashKV::Bytes(3, 0x5A))
+                return false;
+
+            if (kv.getQueueLength("outbox") != expected.size())
+                return false;
+
+            if (!expected.empty() && entryNumber(kv.peekQueue("outbox")) != expected.front())
+                return false;
+
+            for (int step = 0; step < 50; step++)
+            {
+                if (random() % 2 == 0 && expected.size() < MAX_LENGTH)
+                {
+                    if (!kv.pushToQueue("outbox", makeEntry(pushed)))
+                        return false;
+                    expected.push_back(pushed++);
+                }
+                else if (expected.empty())
+                {
+                    if (kv.popFromQueue("outbox").has_value())
+                        return false;
+                }
+                else
+                {
+                    if (entryNumber(kv.popFromQueue("outbox")) != expected.front())
+                        return false;
+                    expected.pop_front();
+                }
+            }
+
+            if (!kv.saveMap())
+                return false;
+        }
+
+        // Draining The Queue After A Final Remount Gives Every Remaining Entry In Order
+        FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+        if (kv.loadMap() != 1)
+            return false;
+
+        for (uint32_t number : expected)
+            if (entryNumber(kv.popFromQueue("outbox")) != number)
+                return false;
+
+        return !kv.popFromQueue("outbox").has_value() && kv.getQueueLength("outbox") == 0;
+    }
+
+    // Cuts Power After Every Possible Flash Operation In Turn While Entries Are Pushed, Popped And Saved
+    bool runPowerCuts()
+    {
+        for (long cut = 0; cut < MAX_CUT; cut++)
+        {
+            FlashKVTests::RamFlash flash(PAGE_SIZE, SECTOR_SIZE, SECTOR_COUNT);
+            std::mt19937 random(static_cast<uint32_t>(cut));
+            uint32_t popped = 0, pushed = 0;
+            uint32_t savedHead = 0, savedTail = 0;
+            {
+                FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+                if (kv.loadMap() == 0)
+                    return false;
+
+                flash.cutPowerAfter(cut, static_cast<uint32_t>(cut));
+                for (int step = 0; step < 300 && !flash.lostPower(); step++)
+                {
+                    if (random() % 2 == 0 && pushed - popped < MAX_LENGTH)
+                    {
+                        if (!kv.pushToQueue("outbox", makeEntry(pushed)))
+                            return false;
+                        pushed++;
+                    }
+                    else if (popped < pushed)
+                    {
+                        if (entryNumber(kv.popFromQueue("outbox")) != popped)
+                            return false;
+                        popped++;
+                    }
+
+                    if (random() % 8 == 0 && kv.saveMap())
+                        savedHead = popped, savedTail = pushed;
+                }
+            }
+
+            // Power Is Back For The Remount, Which Must Find A Run Of Consecutive Entries Within The Two Queues
+            flash.restorePower();
+            FlashKV::FlashKV kv(flash, PAGE_SIZE, SECTOR_SIZE, 0, REGION_SIZE);
+            if (kv.loadMap() == 0)
+                return false;
+
+            auto first = entryNumber(kv.peekQueue("outbox"));
+            uint32_t next = first.value_or(savedTail);
+            if (next < savedHead || next > popped)
+                return false;
+
+            for (size_t length = kv.getQueueLength("outbox"); length > 0; length--)
+                if (entryNumber(kv.popFromQueue("outbox")) != next++)
+                    return false;
+
+            if (next < savedTail || next > pushed)
+            {
+                std::printf("queue ended at entry %u after cut %ld, saved up to %u of %u\n", next, cut, savedTail, pushed);
+                return false;
+            }
+
+            // The Queue Keeps Working, Numbering On From Where It Left Off
+            if (!kv.pushToQueue("outbox", makeEntry(next)) || !kv.saveMap() || entryNumber(kv.popFromQueue("outbox")) != next)
+                return false;
+        }
+
+        return true;
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    auto check = [&failures](bool passed, const char *name)
+    {
+        if (!passed)
+        {
+            std::printf("%s failed\n", name);
+            failures++;
+        }
+    };
+
+    check(runRemounts(), "queue pushes and pops across remounts");
+    check(runPowerCuts(), "queue pushes and pops with power cuts");
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file RamFlash.h
+ * @brief NOR Flash memory simulated in RAM, for the FlashKV tests.
+ *
+ * Programs can only clear bits and erases set whole sectors back to 0xFF, as on real parts. Power can be cut after a
+ * given number of programs and erases: the interrupted operation is torn part way through, and every later operation
+ * fails until power is restored.
+ */
+
+#pragma once
+
+#include <FlashKV/FlashKV.h>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace FlashKVTests
+{
+    class RamFlash final : public FlashKV::FlashDriver
+    {
+    public:
+        RamFlash(size_t pageSize, size_t sectorSize, size_t sectorCount)
+            : pageSize(pageSize), sectorSize(sectorSize), memory(sectorSize * sectorCount, 0xFF)
+        {
+        }
+
+        bool read(uint32_t flashAddress, uint8_t *data, size_t count) override
+        {
+            if (flashAddress + count > memory.size())
+                return false;
+
+            std::memcpy(data, memory.data() + flashAddress, count);
+            return true;
+        }
+
+        bool program(uint32_t flashAddress, const uint8_t *data, size_t count) override
+        {
+            if (flashAddress % pageSize != 0 || count % pageSize != 0 || flashAddress + count > memory.size())
+                return false;
+
+            // A Torn Program Leaves A Random Prefix Of The Data Behind
+            size_t done = powerLeft() ? count : tearSize(count);
+            for (size_t i = 0; i < done; i++)
+                memory[flashAddress + i] &= data[i];
+
+            return done == count && !powerLost;
+        }
+
+        bool erase(uint32_t flashAddress, size_t count) override
+        {
+            if (flashAddress % sectorSize != 0 || count % sectorSize != 0 || flashAddress + count > memory.size())
+                return false;
+
+            // A Torn Erase Leaves A Random Prefix Of The Sector Erased
+            size_t done = powerLeft() ? count : tearSize(count);
+            std::memset(memory.data() + flashAddress, 0xFF, done);
+            return done == count && !powerLost;
+        }
+
+        /**
+         * @brief Cuts power after a number of further programs and erases.
+         *
+         * @param operations The number of operations that complete before the cut, or a negative value for none.
+         * @param seed Seed for the amount of the interrupted operation that reaches Flash memory.
+         */
+        void cutPowerAfter(long operations, uint32_t seed = 0)
+        {
+            operationsLeft = operations;
+            powerLost = false;
+            tornOperation = false;
+            tearRandom.seed(seed);
+        }
+
+        /**
+         * @brief Restores power, so every later operation succeeds.
+         */
+        void restorePower()
+        {
+            operationsLeft = -1;
+            powerLost = false;
+            tornOperation = false;
+        }
+
+        /**
+         * @brief Checks whether power has been cut.
+         */
+        bool lostPower() const { return powerLost; }
+
+        /**
+         * @brief Gives direct access to the simulated memory.
+         */
+        std::vector<uint8_t> &contents() { return memory; }
+
+    private:
+        bool powerLeft()
+        {
+            if (powerLost)
+                return false;
+
+            if (operationsLeft == 0)
+            {
+                powerLost = true;
+                return false;
+            }
+
+            if (operationsLeft > 0)
+                operationsLeft--;
+
+            return true;
+        }
+
+        size_t tearSize(size_t count)
+        {
+            // Only The Operation Interrupted By The Cut Is Torn, Later Ones Never Start
+            if (tornOperation)
+                return 0;
+
+            tornOperation = true;
+            return tearRandom() % (count + 1);
+        }
+
+        size_t pageSize;             // Program unit, which programs must be aligned to.
+        size_t sectorSize;           // Erase unit, which erases must be aligned to.
+        std::vector<uint8_t> memory; // Contents of the simulated part.
+        long operationsLeft = -1;    // Operations that complete before the cut, or negative for none.
+        bool powerLost = false;      // Whether the cut has happened.
+        bool tornOperation = false;  // Whether the interrupted operation has been torn.
+        std::mt19937 tearRandom;     // Source of the amount of the interrupted operation that completes.
+    };
+}